@@ -0,0 +1,103 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "fs.h"
+#include "disk.h"
+
+#define SLICE_BLOCKS 64 // default number of blocks moved per slice
+#define SLICE_DELAY 0   // default pause between slices in milliseconds
+
+static void usage(char *prog) {
+    fprintf(stderr, "usage: %s [-b blocks-per-slice] [-d delay-ms] [-n] disk\n", prog);
+    fprintf(stderr, "  -b  blocks relocated per slice (default %d)\n", SLICE_BLOCKS);
+    fprintf(stderr, "  -d  pause between slices in milliseconds (default %d)\n", SLICE_DELAY);
+    fprintf(stderr, "  -n  only report fragmentation\n");
+}
+
+// print a summary of the volume followed by the extent count of every file
+static void report(char *label) {
+    struct fs_frag_stats stats;
+    if (fs_frag_stats(&stats) == -1) {
+        return;
+    }
+
+    printf("%s:\n", label);
+    printf("  files        %d (%d fragmented)\n", stats.files, stats.fragmented);
+    printf("  file blocks  %d in %d extents\n", stats.blocks, stats.extents);
+    printf("  index blocks %d\n", stats.index_blocks);
+    printf("  free blocks  %d in %d extents (largest %d)\n",
+           stats.free_blocks, stats.free_extents, stats.largest_free);
+
+    char **files;
+    if (fs_listfiles(&files) == -1) {
+        return;
+    }
+    int i;
+    for (i = 0; files[i]; i++) {
+        printf("  %-16s %d extents\n", files[i], fs_file_extents(files[i]));
+    }
+    free(files);
+}
+
+int main(int argc, char **argv) {
+    int slice = SLICE_BLOCKS;
+    int delay = SLICE_DELAY;
+    int dry_run = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "b:d:n")) != -1) {
+        switch (opt) {
+        case 'b':
+            slice = atoi(optarg);
+            break;
+        case 'd':
+            delay = atoi(optarg);
+            break;
+        case 'n':
+            dry_run = 1;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind != argc - 1 || slice <= 0 || delay < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    char *disk_name = argv[optind];
+
+    if (mount_fs(disk_name) == -1) {
+        fprintf(stderr, "%s: cannot mount %s\n", argv[0], disk_name);
+        return 1;
+    }
+
+    report("before");
+
+    if (!dry_run) {
+        // work in slices so the volume stays usable between them
+        int slices = 0;
+        int status;
+        while ((status = fs_defrag(slice)) == 1) {
+            slices++;
+            if (delay) {
+                usleep(delay * 1000);
+            }
+        }
+        if (status == -1) {
+            fprintf(stderr, "%s: defragmentation failed\n", argv[0]);
+            umount_fs(disk_name);
+            return 1;
+        }
+        printf("defragmented in %d slices\n", slices + 1);
+        report("after");
+    }
+
+    if (umount_fs(disk_name) == -1) {
+        fprintf(stderr, "%s: cannot unmount %s\n", argv[0], disk_name);
+        return 1;
+    }
+
+    return 0;
+}
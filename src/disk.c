@@ -3,43 +3,180 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <string.h>
+#include <pthread.h>
+#include <limits.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/file.h>
 
 #include "disk.h"
+#include "ramdisk.h"
+
+static int file_make(char *name, int blocks);
+static int file_open(char *name);
+static int file_close();
+static int file_transfer(int write, int block, int count, char *buf);
+static int check_headers(char **names, int *unit);
+static void start_workers();
+static void stop_workers();
+
+/* image files on the host, optionally striped */
+static struct disk_backend file_backend = {
+  "", file_make, file_open, file_close, file_transfer, NULL
+};
+
+/* backends in the order their name prefixes are tried */
+static struct disk_backend *backends[] = { &ram_backend, &file_backend };
 
 /******************************************************************************/
-static int active = 0;  /* is the virtual disk open (active) */
-static int handle;      /* file handle to virtual disk       */
+static int active = 0;            /* is the virtual disk open (active)        */
+static int size = 0;              /* blocks on the open disk                  */
+static struct disk_backend *backend; /* backend of the open disk              */
+static int handle[MAX_MEMBERS];   /* file handles to the member images        */
+static int members = 0;           /* number of member images                  */
+static int stripe_unit;           /* consecutive blocks placed on one member  */
+static int (*flush)();            /* writes back data cached above the disk   */
+static off_t data_start;          /* bytes before the first block of a member */
+
+#define MEMBER_MAGIC "VFSSTRIP"
+#define MEMBER_VERSION 1
+
+/* first block of each member of a striped disk, so members given in the    */
+/* wrong order, left out or taken from another disk are caught on open      */
+struct member_header {
+  char magic[8];                  /* MEMBER_MAGIC                             */
+  uint32_t version;               /* MEMBER_VERSION                           */
+  uint32_t member;                /* position of this member in the name      */
+  uint32_t members;               /* number of member images                  */
+  uint32_t unit;                  /* stripe unit the disk was made with       */
+  uint64_t volume;                /* same on every member of one disk         */
+};
+
+/* one member's share of a multi-block request */
+struct member_io {
+  int member;                     /* member handled by this request           */
+  int write;                      /* write (1) or read (0)                    */
+  int block;                      /* first block of the whole request         */
+  int count;                      /* blocks in the whole request              */
+  char *buf;                      /* buffer of the whole request              */
+  int status;                     /* 0 on success, -1 on error                */
+  int queued;                     /* waiting for or being served by a worker  */
+};
+
+/* every member of a striped disk has a worker thread for as long as the    */
+/* disk is open; a request serves the first member it touches itself, hands */
+/* the other members' shares to their workers and waits for them            */
+static pthread_t worker[MAX_MEMBERS];
+static struct member_io work[MAX_MEMBERS]; /* share handed to each worker     */
+static int workers = 0;           /* workers running                          */
+static int pending;               /* shares not yet done                      */
+static int stopping;              /* workers should exit                      */
+static pthread_mutex_t work_lock = PTHREAD_MUTEX_INITIALIZER; /* work, pending, stopping */
+static pthread_cond_t work_ready = PTHREAD_COND_INITIALIZER;  /* a share was queued     */
+static pthread_cond_t work_done = PTHREAD_COND_INITIALIZER;   /* pending dropped to 0   */
+static pthread_mutex_t request_lock = PTHREAD_MUTEX_INITIALIZER; /* one multi-member request at a time */
 
 /******************************************************************************/
+/* split "img0,img1,...[@unit]" into member names and a stripe unit (0 when  */
+/* none is given); the names point into copy, which the caller frees. A      */
+/* single image name is taken as it is, "@" and all                          */
+static int parse_name(char *name, char *copy, char **names, int *unit)
+{
+  char *at, *end, *tok, *save;
+  long value;
+  int n = 0;
+
+  strcpy(copy, name);
+
+  /* a trailing "@<number>" sets the stripe unit */
+  *unit = 0;
+  if (strchr(copy, ',') && (at = strrchr(copy, '@'))) {
+    value = strtol(at + 1, &end, 10);
+    if (end != at + 1 && *end == '\0') {
+      if (value < 1 || value > INT_MAX / MAX_MEMBERS) {
+        fprintf(stderr, "disk: invalid stripe unit\n");
+        return -1;
+      }
+      *at = '\0';
+      *unit = value;
+    }
+  }
+
+  for (tok = strtok_r(copy, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+    if (n == MAX_MEMBERS) {
+      fprintf(stderr, "disk: too many member images\n");
+      return -1;
+    }
+    names[n++] = tok;
+  }
+
+  if (n == 0) {
+    fprintf(stderr, "disk: invalid file name\n");
+    return -1;
+  }
+
+  return n;
+}
+
+/* blocks each member needs to hold its share of a disk */
+static int member_blocks(int n, int unit, int blocks)
+{
+  int stripes = (blocks + unit - 1) / unit;
+
+  return (stripes + n - 1) / n * unit;
+}
+
+/* value that tells the members of one striped disk from those of another    */
+static uint64_t volume_id()
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_REALTIME, &now);
+  return ((uint64_t) now.tv_sec << 32) ^ (uint64_t) now.tv_nsec ^ ((uint64_t) getpid() << 16);
+}
+
+/******************************************************************************/
+/* pick the backend whose prefix starts the name                              */
+static struct disk_backend *find_backend(char *name)
+{
+  int i;
+
+  for (i = 0; i < (int) (sizeof(backends) / sizeof(backends[0])); ++i)
+    if (strncmp(name, backends[i]->prefix, strlen(backends[i]->prefix)) == 0)
+      return backends[i];
+
+  return NULL;
+}
+
 int make_disk(char *name)
 {
-  int f, cnt;
-  char buf[BLOCK_SIZE];
+  return make_disk_sized(name, DISK_BLOCKS);
+}
+
+int make_disk_sized(char *name, int blocks)
+{
+  struct disk_backend *b;
 
-  if (!name) {
+  if (!name || !(b = find_backend(name))) {
     fprintf(stderr, "make_disk: invalid file name\n");
     return -1;
   }
 
-  if ((f = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
-    perror("make_disk: cannot open file");
+  if (blocks < 1) {
+    fprintf(stderr, "make_disk: invalid disk size\n");
     return -1;
   }
 
-  memset(buf, 0, BLOCK_SIZE);
-  for (cnt = 0; cnt < DISK_BLOCKS; ++cnt)
-    write(f, buf, BLOCK_SIZE);
-
-  close(f);
-
-  return 0;
+  return b->make(name + strlen(b->prefix), blocks);
 }
 
 int open_disk(char *name)
 {
-  int f;
+  struct disk_backend *b;
+  int blocks;
 
-  if (!name) {
+  if (!name || !(b = find_backend(name))) {
     fprintf(stderr, "open_disk: invalid file name\n");
     return -1;
   }
@@ -49,12 +186,11 @@ int open_disk(char *name)
     return -1;
   }
 
-  if ((f = open(name, O_RDWR, 0644)) < 0) {
-    perror("open_disk: cannot open file");
+  if ((blocks = b->open(name + strlen(b->prefix))) < 0)
     return -1;
-  }
 
-  handle = f;
+  backend = b;
+  size = blocks;
   active = 1;
 
   return 0;
@@ -67,59 +203,441 @@ int close_disk()
     return -1;
   }
 
-  close(handle);
+  backend->close();
 
-  active = handle = 0;
+  active = size = 0;
+  flush = NULL;
 
   return 0;
 }
 
-int block_write(int block, char *buf)
+int disk_blocks()
+{
+  return size;
+}
+
+int disk_snapshot(char *name)
 {
   if (!active) {
-    fprintf(stderr, "block_write: disk not active\n");
+    fprintf(stderr, "disk_snapshot: disk not active\n");
     return -1;
   }
 
-  if ((block < 0) || (block >= DISK_BLOCKS)) {
-    fprintf(stderr, "block_write: block index out of bounds\n");
+  if (!name || !backend->snapshot) {
+    fprintf(stderr, "disk_snapshot: not supported by this disk\n");
     return -1;
   }
 
-  if (lseek(handle, block * BLOCK_SIZE, SEEK_SET) < 0) {
-    perror("block_write: failed to lseek");
+  /* a mounted file system writes back what it caches first */
+  if (flush && flush() < 0) {
+    fprintf(stderr, "disk_snapshot: cannot write back cached data\n");
     return -1;
   }
 
-  if (write(handle, buf, BLOCK_SIZE) < 0) {
-    perror("block_write: failed to write");
+  return backend->snapshot(name);
+}
+
+void disk_set_flush(int (*fn)())
+{
+  flush = fn;
+}
+
+/******************************************************************************/
+/* file backend                                                               */
+static int file_make(char *name, int blocks)
+{
+  int f, m, n, unit;
+  off_t len;
+  char *names[MAX_MEMBERS];
+  char *copy;
+  struct member_header header;
+
+  copy = malloc(strlen(name) + 1);
+  if ((n = parse_name(name, copy, names, &unit)) < 0) {
+    free(copy);
     return -1;
   }
+  if (unit == 0)
+    unit = STRIPE_UNIT;
+
+  /* members of a striped disk start with a header block */
+  if (n == 1)
+    len = (off_t) blocks * BLOCK_SIZE;
+  else
+    len = ((off_t) member_blocks(n, unit, blocks) + 1) * BLOCK_SIZE;
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, MEMBER_MAGIC, sizeof(header.magic));
+  header.version = MEMBER_VERSION;
+  header.members = n;
+  header.unit = unit;
+  header.volume = volume_id();
+
+  /* size the (sparse) images; blocks read back as zeros until written.
+     an image in use by another process is left alone, so it is only
+     emptied once the lock is held */
+  for (m = 0; m < n; ++m) {
+    if ((f = open(names[m], O_WRONLY | O_CREAT, 0644)) < 0) {
+      perror("make_disk: cannot open file");
+      free(copy);
+      return -1;
+    }
+
+    if (flock(f, LOCK_EX | LOCK_NB) < 0) {
+      fprintf(stderr, "make_disk: %s is in use\n", names[m]);
+      close(f);
+      free(copy);
+      return -1;
+    }
+
+    if (ftruncate(f, 0) < 0 || ftruncate(f, len) < 0) {
+      perror("make_disk: cannot size file");
+      close(f);
+      free(copy);
+      return -1;
+    }
+
+    header.member = m;
+    if (n > 1 && pwrite(f, &header, sizeof(header), 0) != sizeof(header)) {
+      perror("make_disk: cannot write member header");
+      close(f);
+      free(copy);
+      return -1;
+    }
+
+    close(f);
+  }
+
+  free(copy);
 
   return 0;
 }
 
+/* check that the open members are the members of one striped disk, in the  */
+/* order it was made with; unit is the stripe unit given with the name, or 0 */
+/* to use the one the disk was made with                                     */
+static int check_headers(char **names, int *unit)
+{
+  struct member_header header, first;
+  int m;
+
+  for (m = 0; m < members; ++m) {
+    if (pread(handle[m], &header, sizeof(header), 0) != sizeof(header) ||
+        memcmp(header.magic, MEMBER_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != MEMBER_VERSION) {
+      fprintf(stderr, "open_disk: %s is not a member of a striped disk\n", names[m]);
+      return -1;
+    }
+    if (m == 0)
+      first = header;
+
+    if (header.volume != first.volume || header.members != (uint32_t) members) {
+      fprintf(stderr, "open_disk: %s belongs to another disk\n", names[m]);
+      return -1;
+    }
+    if (header.member != (uint32_t) m) {
+      fprintf(stderr, "open_disk: %s is member %u of the disk, not %d\n", names[m], header.member, m);
+      return -1;
+    }
+  }
+
+  if (first.unit < 1 || first.unit > INT_MAX / MAX_MEMBERS) {
+    fprintf(stderr, "open_disk: invalid stripe unit\n");
+    return -1;
+  }
+  if (*unit != 0 && *unit != (int) first.unit) {
+    fprintf(stderr, "open_disk: disk was made with stripe unit %u\n", first.unit);
+    return -1;
+  }
+  *unit = first.unit;
+
+  return 0;
+}
+
+static int file_open(char *name)
+{
+  int f, m, n, unit;
+  off_t smallest = -1;
+  struct stat st;
+  char *names[MAX_MEMBERS];
+  char *copy;
+
+  copy = malloc(strlen(name) + 1);
+  if ((n = parse_name(name, copy, names, &unit)) < 0) {
+    free(copy);
+    return -1;
+  }
+
+  for (m = 0; m < n; ++m) {
+    if ((f = open(names[m], O_RDWR, 0644)) < 0) {
+      perror("open_disk: cannot open file");
+      while (m > 0)
+        close(handle[--m]);
+      free(copy);
+      return -1;
+    }
+    handle[m] = f;
+
+    /* one process at a time; the lock goes away with the descriptor */
+    if (flock(f, LOCK_EX | LOCK_NB) < 0) {
+      fprintf(stderr, "open_disk: %s is in use\n", names[m]);
+      while (m >= 0)
+        close(handle[m--]);
+      free(copy);
+      return -1;
+    }
+
+    if (fstat(f, &st) == 0 && (smallest < 0 || st.st_size < smallest))
+      smallest = st.st_size;
+  }
+
+  members = n;
+
+  if (n > 1 && check_headers(names, &unit) < 0) {
+    free(copy);
+    file_close();
+    return -1;
+  }
+
+  free(copy);
+
+  stripe_unit = unit ? unit : STRIPE_UNIT;
+  data_start = (n > 1) ? BLOCK_SIZE : 0;
+
+  /* every member holds the same number of whole stripes */
+  smallest = (smallest - data_start) / BLOCK_SIZE;
+  if (n > 1)
+    smallest = smallest / unit * unit * n;
+
+  if (smallest < 1 || smallest > INT_MAX) {
+    fprintf(stderr, "open_disk: invalid disk size\n");
+    file_close();
+    return -1;
+  }
+
+  start_workers();
+
+  return smallest;
+}
+
+static int file_close()
+{
+  int m;
+
+  stop_workers();
+
+  for (m = 0; m < members; ++m)
+    close(handle[m]);
+
+  members = 0;
+
+  return 0;
+}
+
+/******************************************************************************/
+/* transfer the stripes of a request that live on one member                  */
+static void *member_transfer(void *arg)
+{
+  struct member_io *io = arg;
+  int b, seg, stripe, last = io->block + io->count;
+  ssize_t done, n, len;
+  off_t pos;
+  char *p;
+
+  io->status = 0;
+
+  for (b = io->block; b < last; b += seg) {
+    /* a single image holds the blocks in order, so the run is one transfer */
+    seg = (members == 1) ? last - b : stripe_unit - b % stripe_unit;
+    if (seg > last - b)
+      seg = last - b;
+
+    stripe = b / stripe_unit;
+    if (stripe % members != io->member)
+      continue;
+
+    /* stripe s sits at stripe s / members of its member */
+    pos = ((off_t) (stripe / members) * stripe_unit + b % stripe_unit) * BLOCK_SIZE + data_start;
+    p = io->buf + (off_t) (b - io->block) * BLOCK_SIZE;
+    len = (ssize_t) seg * BLOCK_SIZE;
+
+    for (done = 0; done < len; done += n) {
+      if (io->write)
+        n = pwrite(handle[io->member], p + done, len - done, pos + done);
+      else
+        n = pread(handle[io->member], p + done, len - done, pos + done);
+
+      if (n < 0) {
+        perror(io->write ? "block_write: failed to write" : "block_read: failed to read");
+        io->status = -1;
+        return NULL;
+      }
+      if (n == 0) {
+        fprintf(stderr, "%s: unexpected end of disk\n", io->write ? "block_write" : "block_read");
+        io->status = -1;
+        return NULL;
+      }
+    }
+  }
+
+  return NULL;
+}
+
+/* serve the shares of requests handed to one member                         */
+static void *member_worker(void *arg)
+{
+  struct member_io *io = arg;
+
+  pthread_mutex_lock(&work_lock);
+  for (;;) {
+    while (!io->queued && !stopping)
+      pthread_cond_wait(&work_ready, &work_lock);
+    if (stopping)
+      break;
+    pthread_mutex_unlock(&work_lock);
+
+    member_transfer(io);
+
+    pthread_mutex_lock(&work_lock);
+    io->queued = 0;
+    if (--pending == 0)
+      pthread_cond_signal(&work_done);
+  }
+  pthread_mutex_unlock(&work_lock);
+
+  return NULL;
+}
+
+/* start a worker for every member of a striped disk; a member whose worker   */
+/* can not be started is served by the calling thread                        */
+static void start_workers()
+{
+  int m;
+
+  stopping = 0;
+  for (m = 0; m < members && members > 1; ++m) {
+    work[m].member = m;
+    work[m].queued = 0;
+    if (pthread_create(&worker[m], NULL, member_worker, &work[m]) != 0)
+      break;
+  }
+  workers = (members > 1) ? m : 0;
+}
+
+static void stop_workers()
+{
+  int m;
+
+  pthread_mutex_lock(&work_lock);
+  stopping = 1;
+  pthread_cond_broadcast(&work_ready);
+  pthread_mutex_unlock(&work_lock);
+
+  for (m = 0; m < workers; ++m)
+    pthread_join(worker[m], NULL);
+
+  workers = 0;
+}
+
+/* run a request on every member it touches, handing all but the first of   */
+/* them to their workers                                                     */
+static int file_transfer(int write, int block, int count, char *buf)
+{
+  struct member_io io;
+  int first = block / stripe_unit, last = (block + count - 1) / stripe_unit;
+  int m, s, status;
+
+  io.member = first % members;
+  io.write = write;
+  io.block = block;
+  io.count = count;
+  io.buf = buf;
+
+  /* a request on one member needs no other thread */
+  if (first == last || members == 1) {
+    member_transfer(&io);
+    return io.status;
+  }
+
+  pthread_mutex_lock(&request_lock);
+
+  pthread_mutex_lock(&work_lock);
+  pending = 0;
+  for (s = first + 1; s <= last && s < first + members; ++s) {
+    m = s % members;
+    work[m].write = write;
+    work[m].block = block;
+    work[m].count = count;
+    work[m].buf = buf;
+    work[m].status = 0;
+    if (m < workers) {
+      work[m].queued = 1;
+      pending++;
+    }
+  }
+  pthread_cond_broadcast(&work_ready);
+  pthread_mutex_unlock(&work_lock);
+
+  member_transfer(&io);
+  status = io.status;
+
+  /* members without a worker */
+  for (s = first + 1; s <= last && s < first + members; ++s) {
+    m = s % members;
+    if (m >= workers)
+      member_transfer(&work[m]);
+  }
+
+  pthread_mutex_lock(&work_lock);
+  while (pending > 0)
+    pthread_cond_wait(&work_done, &work_lock);
+  pthread_mutex_unlock(&work_lock);
+
+  for (s = first + 1; s <= last && s < first + members; ++s)
+    if (work[s % members].status < 0)
+      status = -1;
+
+  pthread_mutex_unlock(&request_lock);
+
+  return status;
+}
+
+int block_write(int block, char *buf)
+{
+  return block_write_n(block, 1, buf);
+}
+
 int block_read(int block, char *buf)
+{
+  return block_read_n(block, 1, buf);
+}
+
+int block_write_n(int block, int count, char *buf)
 {
   if (!active) {
-    fprintf(stderr, "block_read: disk not active\n");
+    fprintf(stderr, "block_write: disk not active\n");
     return -1;
   }
 
-  if ((block < 0) || (block >= DISK_BLOCKS)) {
-    fprintf(stderr, "block_read: block index out of bounds\n");
+  if ((block < 0) || (count < 1) || (count > size - block)) {
+    fprintf(stderr, "block_write: block index out of bounds\n");
     return -1;
   }
 
-  if (lseek(handle, block * BLOCK_SIZE, SEEK_SET) < 0) {
-    perror("block_read: failed to lseek");
+  return backend->transfer(1, block, count, buf);
+}
+
+int block_read_n(int block, int count, char *buf)
+{
+  if (!active) {
+    fprintf(stderr, "block_read: disk not active\n");
     return -1;
   }
 
-  if (read(handle, buf, BLOCK_SIZE) < 0) {
-    perror("block_read: failed to read");
+  if ((block < 0) || (count < 1) || (count > size - block)) {
+    fprintf(stderr, "block_read: block index out of bounds\n");
     return -1;
   }
 
-  return 0;
+  return backend->transfer(0, block, count, buf);
 }
@@ -1,14 +1,41 @@
 #ifndef _DISK_H_
 #define _DISK_H_
 
-#define DISK_BLOCKS  8192      /* number of blocks on the disk                */
+#define DISK_BLOCKS  8192      /* number of blocks on a default disk          */
 #define BLOCK_SIZE   4096      /* block size on "disk"                        */
+#define MAX_MEMBERS  16        /* most image files a disk can be striped over */
+#define STRIPE_UNIT  16        /* default blocks per stripe on each member    */
+
+/* A disk name is a single image file, or a comma separated list of image     */
+/* files ("a.img,b.img") that blocks are striped across in runs of            */
+/* STRIPE_UNIT blocks. A trailing "@<blocks>" ("a.img,b.img@64") picks        */
+/* another stripe unit. Each member starts with a header recording the list  */
+/* and unit, checked when the disk is opened, so the names must be given in  */
+/* the same order every time. A name starting with "ram:" is a disk held in  */
+/* memory (see ramdisk.h).                                                    */
+
+/* operations a kind of disk provides; name has the backend's prefix removed */
+struct disk_backend {
+  char *prefix;                                        /* name prefix selecting the backend */
+  int (*make)(char *name, int blocks);                 /* create an empty disk              */
+  int (*open)(char *name);                             /* attach, returning its size        */
+  int (*close)();                                      /* detach from the open disk         */
+  int (*transfer)(int write, int block, int count, char *buf); /* move count blocks   */
+  int (*snapshot)(char *name);                         /* copy the disk to a file, or NULL  */
+};
 
 int make_disk(char *name);     /* create an empty, virtual disk file          */
+int make_disk_sized(char *name, int blocks); /* create a disk of blocks blocks */
 int open_disk(char *name);     /* open a virtual disk (file)                  */
 int close_disk();              /* close a previously opened disk (file)       */
+int disk_snapshot(char *name); /* save the open disk to an image file         */
+void disk_set_flush(int (*fn)()); /* call fn before each snapshot until closed */
+int disk_blocks();             /* number of blocks on the open disk           */
 
 int block_write(int block, char *buf); /* write a block of size BLOCK_SIZE to disk    */
 int block_read(int block, char *buf); /* read a block of size BLOCK_SIZE from disk   */
 
+int block_write_n(int block, int count, char *buf); /* write count consecutive blocks */
+int block_read_n(int block, int count, char *buf);  /* read count consecutive blocks  */
+
 #endif
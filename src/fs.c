@@ -1,21 +1,32 @@
 #include "fs.h"
 #include "disk.h"
+#include "trace.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <string.h>
-
-#define MAX_FILES_ALLOWED 64    // max 64 files at any given time
-#define MAX_F_NAME 15   // max 15 character filenames
-#define MAX_FILDES 32   // support a maximum of 32 file descriptors that can be open simultaneously
-#define STORAGE 4096 * 4096 // maximum file size is 16M (4,096 blocks, each 4K)
-#define DISK_BLOCKS 8192
+#include <stdint.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+
+#define FILDES_CHUNK 1024       // descriptors added each time the descriptor table grows
+#define FILDES_MAX_CHUNKS 1024  // the table grows to at most 1M open descriptors
 #define BLOCK_SIZE 4096
+#define INDEX_FANOUT (BLOCK_SIZE / 4) // block numbers held by an index block
+#define INDEX_DEPTH 3  // most levels in a file's block index
+#define STORAGE ((off_t) 1 << 42) // maximum file size is 4T (1024^3 blocks, each 4K)
+#define FAT_CACHE_PAGES 64 // default number of FAT blocks kept in memory
+#define RECLAIM_MAX 256 // most freed chains waiting in the super block
+#define RECLAIM_BATCH 256 // blocks the reclaim worker frees before letting others at the FAT
 
 // enumeration for file allocation table entries
 #define FREE -1         // empty slot in FAT
 #define END_MARKER -2   // denote end of file 
+#define RESERVED -3     // held by the defragmenter as a relocation target
+#define FAT_ERROR -4    // returned for an entry whose FAT block could not be read
 
 // super block to store information of other data structures
 struct super_block {
@@ -24,69 +35,572 @@ struct super_block {
     int dir_idx; // First block of directory
     int dir_len; // Length of directory in blocks
     int data_idx; // First block of file-data
+    int nblocks; // Number of blocks on the disk
+    int fat_width; // Bytes per FAT entry (2 when block numbers fit, else 4)
+    int reclaim_len; // Number of chains waiting to be freed
+    int reclaim[RECLAIM_MAX]; // First blocks of chains unlinked by delete or truncate, oldest first
 };
 
 // directory entry to stores file metadata
 struct dir_entry {
     int used; // Is this file-”slot” in use
     char name [MAX_F_NAME + 1]; // DOH!
-    int size; // file size
+    int64_t size; // file size
     int head; // first data block of file
     int ref_cnt;
-    // how many open file descriptors are there?
-    // ref_cnt > 0 -> cannot delete file
+    // kept for the on-disk layout; open descriptors are counted in struct open_file
+    int index; // root block of the file's block index, -1 while the file has a single block
+    int depth; // levels in the block index (0 when there is none)
+    int index_chain; // FAT chain linking every index block of the file, -1 if there are none
+};
+
+// state shared by every descriptor open on the same file -- only meaningful while system is mounted
+struct open_file {
+    int entry; // directory entry of the file
+    atomic_int refs; // how many open file descriptors are there? refs > 0 -> cannot delete file
+    int map_index; // last block of the file looked up (-1 if none), so sequential access need not walk the FAT from the head
+    int map_block; // where that block is on disk
+    int map_prev; // the block before it (-1 if it is the first)
+    int leaf; // index block held in leaf_data, -1 if none
+    int leaf_base; // first logical block whose place leaf holds
+    int leaf_dirty; // leaf_data changed since it was read from disk
+    int32_t *leaf_data; // allocated on first use
 };
 
 // file descriptor used for file operations -- only meaningful while system is mounted
 struct file_descriptor {
-    int used; // fildes in use
-    int file; // the first block of the file (f) to which fildes refers too
-    int offset; // position of fildes within f
+    _Atomic(struct open_file *) file; // file to which fildes refers, NULL when fildes is free
+    off_t offset; // position of fildes within file
+    atomic_int next_free; // next descriptor on the free list, -1 at the end
 };
 
 // global variables and data structures
 struct super_block *fs; // super block
-struct file_descriptor fildes_array[MAX_FILDES]; // array of 32 file descriptors
-int *FAT;               // to be populated with the FAT data
 struct dir_entry *DIR;  // to be populated with the directory data
 
+// descriptor table, grown a chunk at a time so descriptors never move once handed out
+struct file_descriptor *fildes_table[FILDES_MAX_CHUNKS];
+atomic_int fildes_chunks = 0;                       // chunks allocated
+_Atomic uint64_t fildes_free = 0;                   // free list head: change count << 32 | (descriptor + 1), 0 when empty
+pthread_mutex_t fildes_grow = PTHREAD_MUTEX_INITIALIZER; // held while adding a chunk
+pthread_rwlock_t dir_lock = PTHREAD_RWLOCK_INITIALIZER; // held shared by open, exclusive by create and delete
+_Atomic(struct open_file *) open_files[MAX_FILES_ALLOWED]; // open file of each directory entry, created on first open
+
 int file_counter = 0;   // number of files in system
 int mounted = 0;        // if file system has been mounted
 int validfs = 0;        // if valid file system has been created
 
+// FAT block held in memory
+struct fat_page {
+    int page;       // FAT block held, -1 if the slot is empty
+    int dirty;      // changed since it was read from disk
+    int referenced; // used since the clock hand last passed
+    char *data;     // allocated on first use
+};
+
+// the FAT is read a block at a time as it is used and at most fat_budget blocks are kept
+struct fat_page *fat_cache;         // FAT blocks in memory
+int *fat_slot;                      // cache slot of each FAT block, -1 if not in memory
+int fat_cache_len = 0;              // slots in fat_cache
+int fat_budget = FAT_CACHE_PAGES;   // most FAT blocks to keep in memory
+int fat_hand = 0;                   // next slot considered for eviction
+int fat_free_hint = 0;              // no free block below this one
+int fat_high_hint = 0;              // no free block above this one
+
+// blocks unlinked by fs_delete and fs_truncate are freed by a background worker
+pthread_mutex_t fat_lock = PTHREAD_MUTEX_INITIALIZER;   // held for FAT, hint and reclaim list
+pthread_cond_t reclaim_work = PTHREAD_COND_INITIALIZER; // chains were queued or the worker should stop
+pthread_cond_t reclaim_done = PTHREAD_COND_INITIALIZER; // the worker freed some blocks
+pthread_t reclaim_thread;
+int reclaim_stop = 0;               // worker should exit
+int reclaim_failed = 0;             // worker gave up on a FAT error; queued chains stay allocated
+int reclaim_running = 0;            // the worker has been started and not yet joined
+int reclaim_run_start = 0;          // blocks [reclaim_run_start, reclaim_run_end) were held by the
+int reclaim_run_end = 0;            // defragmenter for a plan it dropped; the worker frees them
+
+#define DEFRAG_MOVE_COST 64 // budget of one block moved, in FAT entries examined (see fs_defrag)
+
+// sweeps of a defragmentation run, each visiting every file
+#define DEFRAG_RAISE 0  // move index blocks up to the end of the disk
+#define DEFRAG_JOIN 1   // make fragmented files contiguous
+#define DEFRAG_SLIDE 2  // slide contiguous files down into gaps below them
+
+// steps of relocating one file
+#define DEFRAG_PICK 0   // choose the next file
+#define DEFRAG_WALK 1   // list the file's blocks
+#define DEFRAG_SEARCH 2 // find and reserve a destination run
+#define DEFRAG_MOVE 3   // move the blocks into the run
+#define DEFRAG_INDEX_WALK 4 // list the file's index blocks
+#define DEFRAG_INDEX_MOVE 5 // move them up
+#define DEFRAG_SORT 6   // sort the listed blocks by block number
+
+// block of the file being relocated and its position within the file (or, for an index
+// block, in defrag.nodes)
+struct defrag_block {
+    int block;
+    int index;
+};
+
+// index block of the file being relocated
+struct defrag_node {
+    int block;
+    int parent;     // position of the index block above it in defrag.nodes, -1 for the root
+    int slot;       // where the parent holds it
+    int level;      // 1 for the bottom level
+};
+
+// state of an incremental defragmentation run (see fs_defrag), kept between calls
+struct defrag_state {
+    int active;     // a run is in progress
+    int sweep;      // DEFRAG_* sweep under way
+    int step;       // DEFRAG_* step reached with the current file
+    int cursor;     // first block that may be free
+    int entry;      // directory entry being relocated, -1 between files
+    struct defrag_block *blocks; // the file's blocks, sorted by block once walked
+    struct defrag_block *sorted; // as much room again, for merging blocks into
+    int capacity;   // room in blocks
+    int length;     // blocks in the file
+    int width;      // length of the sorted runs being merged
+    int start;      // first block of the pair of runs being merged
+    int left;       // next block of the first run of the pair
+    int right;      // next block of the second
+    int extents;    // contiguous runs of blocks in the file
+    int walk;       // next block to list, -1 once the chain has been walked
+    int limit;      // highest first block of a destination run worth trying
+    int target;     // first block of the destination run being tried or in use
+    int probe;      // next block of the run to check
+    int moved;      // logical blocks already placed in the destination run
+    int prev;       // the last of them, -1 if none
+    int depth;      // levels in the file's block index when it was picked
+    struct defrag_node *nodes; // the file's index blocks, parents before children
+    int node_capacity; // room in nodes
+    int node_count; // index blocks in nodes
+    int high;       // last block that may be free
+    char done[MAX_FILES_ALLOWED]; // entries already visited during this sweep
+};
+
+struct defrag_state defrag = {0, 0, DEFRAG_PICK, 0, -1};
+
+// calls are recorded while a trace is open (see fs_trace_start)
+atomic_int tracing = 0;
+int trace_from_env = 0;    // VFS_TRACE has been looked at
+
+static void defrag_release();
+static void defrag_end();
+static int fs_sync();
+static int leaf_flush(struct open_file *file);
+
+// allocate in-memory copies of the metadata blocks (each occupies full blocks on disk)
+static void alloc_metadata() {
+    if (!fs) {
+        fs = calloc(1, BLOCK_SIZE);
+    }
+    if (!DIR) {
+        DIR = calloc(1, BLOCK_SIZE);
+    }
+}
+
+// bytes per FAT entry and FAT blocks needed for a disk of nblocks blocks
+static int fat_width(int nblocks) {
+    return nblocks <= INT16_MAX ? 2 : 4;
+}
+
+static int fat_blocks(int nblocks) {
+    return ((long long) nblocks * fat_width(nblocks) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+// bring a FAT block into memory, evicting (and writing back) the least recently used one
+static struct fat_page *fat_page(int page) {
+    int slot = fat_slot[page];
+    if (slot >= 0) {
+        fat_cache[slot].referenced = 1;
+        return &fat_cache[slot];
+    }
+
+    // second chance: skip slots used since the hand last passed
+    while (fat_cache[fat_hand].page >= 0 && fat_cache[fat_hand].referenced) {
+        fat_cache[fat_hand].referenced = 0;
+        fat_hand = (fat_hand + 1) % fat_cache_len;
+    }
+    slot = fat_hand;
+    fat_hand = (fat_hand + 1) % fat_cache_len;
+
+    struct fat_page *victim = &fat_cache[slot];
+    if (victim->page >= 0) {
+        if (victim->dirty && block_write(fs->fat_idx + victim->page, victim->data) == -1) {
+            return NULL;
+        }
+        fat_slot[victim->page] = -1;
+        victim->page = -1;
+    }
+    if (!victim->data && !(victim->data = malloc(BLOCK_SIZE))) {
+        return NULL;
+    }
+    if (block_read(fs->fat_idx + page, victim->data) == -1) {
+        return NULL;
+    }
+
+    victim->page = page;
+    victim->dirty = 0;
+    victim->referenced = 1;
+    fat_slot[page] = slot;
+    return victim;
+}
+
+// read FAT entry with fat_lock held; blocks out of range read as END_MARKER so walks stop there,
+// and FAT_ERROR is returned when the FAT block can not be brought into memory
+static int fat_read(int block) {
+    if (block < 0 || block >= fs->nblocks) {
+        return END_MARKER;
+    }
+
+    int per_page = BLOCK_SIZE / fs->fat_width;
+    struct fat_page *page = fat_page(block / per_page);
+    if (!page) {
+        return FAT_ERROR;
+    }
+    if (fs->fat_width == 2) {
+        return ((int16_t *) page->data)[block % per_page];
+    }
+    return ((int32_t *) page->data)[block % per_page];
+}
+
+// update FAT entry with fat_lock held; returns -1 if the FAT block can not be brought into memory
+static int fat_write(int block, int value) {
+    if (block < 0 || block >= fs->nblocks) {
+        return -1;
+    }
+
+    int per_page = BLOCK_SIZE / fs->fat_width;
+    struct fat_page *page = fat_page(block / per_page);
+    if (!page) {
+        return -1;
+    }
+    if (fs->fat_width == 2) {
+        ((int16_t *) page->data)[block % per_page] = value;
+    } else {
+        ((int32_t *) page->data)[block % per_page] = value;
+    }
+    page->dirty = 1;
+
+    if (value == FREE && block < fat_free_hint) {
+        fat_free_hint = block;
+    }
+    if (value == FREE && block > fat_high_hint) {
+        fat_high_hint = block;
+    }
+    return 0;
+}
+
+static int fat_get(int block) {
+    pthread_mutex_lock(&fat_lock);
+    int value = fat_read(block);
+    pthread_mutex_unlock(&fat_lock);
+    return value;
+}
+
+static int fat_set(int block, int value) {
+    pthread_mutex_lock(&fat_lock);
+    int status = fat_write(block, value);
+    pthread_mutex_unlock(&fat_lock);
+    return status;
+}
+
+// write changed FAT blocks back to disk
+static int fat_flush() {
+    int status = 0;
+    int i;
+    for (i = 0; i < fat_cache_len; i++) {
+        if (fat_cache[i].page >= 0 && fat_cache[i].dirty) {
+            if (block_write(fs->fat_idx + fat_cache[i].page, fat_cache[i].data) == -1) {
+                status = -1;
+            } else {
+                fat_cache[i].dirty = 0;
+            }
+        }
+    }
+    return status;
+}
+
+// set up an empty FAT cache sized by the budget
+static int fat_open() {
+    int i;
+    fat_cache_len = fs->fat_len < fat_budget ? fs->fat_len : fat_budget;
+    fat_cache = calloc(fat_cache_len, sizeof(struct fat_page));
+    fat_slot = malloc(fs->fat_len * sizeof(int));
+    if (!fat_cache || !fat_slot) {
+        free(fat_cache);
+        free(fat_slot);
+        return -1;
+    }
+    for (i = 0; i < fat_cache_len; i++) {
+        fat_cache[i].page = -1;
+    }
+    for (i = 0; i < fs->fat_len; i++) {
+        fat_slot[i] = -1;
+    }
+    fat_hand = 0;
+    fat_free_hint = fs->data_idx;
+    fat_high_hint = fs->nblocks - 1;
+    return 0;
+}
+
+static void fat_close() {
+    int i;
+    for (i = 0; i < fat_cache_len; i++) {
+        free(fat_cache[i].data);
+    }
+    free(fat_cache);
+    free(fat_slot);
+    fat_cache = NULL;
+    fat_slot = NULL;
+    fat_cache_len = 0;
+}
+
+// search the data blocks from *hint in direction step (1 or -1) for a free block with
+// fat_lock held, moving the hint past the blocks found in use; when the disk is full but
+// freed chains are still queued, wait for the worker to free them. returns -1 when the
+// disk is full and FAT_ERROR when the FAT can not be read
+static int fat_scan(int *hint, int step) {
+    while (1) {
+        int j;
+        for (j = *hint; j >= fs->data_idx && j < fs->nblocks; j += step) {
+            int value = fat_read(j);
+            if (value == FAT_ERROR) {
+                *hint = j;
+                return FAT_ERROR;
+            }
+            if (value == FREE) {
+                *hint = j + step;
+                return j;
+            }
+        }
+        *hint = j;
+
+        // no available slots
+        if ((fs->reclaim_len == 0 && reclaim_run_start == reclaim_run_end) || reclaim_failed) {
+            return -1;
+        }
+        pthread_cond_wait(&reclaim_done, &fat_lock);
+    }
+}
+
+// mark block j found by fat_scan as the end of a chain and drop fat_lock, passing on
+// the errors of fat_scan
+static int fat_take(int j) {
+    if (j >= 0 && fat_write(j, END_MARKER) == -1) {
+        j = FAT_ERROR;
+    }
+    pthread_mutex_unlock(&fat_lock);
+    return j;
+}
+
+// find a free block, trying the one after prev first, and mark it as the end of a file
+// returns -1 when the disk is full and FAT_ERROR when the FAT can not be read or written
+static int fat_alloc(int prev) {
+    pthread_mutex_lock(&fat_lock);
+    int j = prev + 1;
+    if (prev < 0 || fat_read(j) != FREE) {
+        j = fat_scan(&fat_free_hint, 1);
+    }
+    return fat_take(j);
+}
+
+// find a free block for an index block, searching down from the end of the disk so index
+// blocks stay out of the runs that files grow into from the start
+static int fat_alloc_high() {
+    pthread_mutex_lock(&fat_lock);
+    return fat_take(fat_scan(&fat_high_hint, -1));
+}
+
+// free up to RECLAIM_BATCH blocks of the oldest queued chain, with fat_lock held;
+// returns -1 on a FAT error, leaving the rest of the chain queued
+static int reclaim_batch() {
+    int block = fs->reclaim[0];
+    int n;
+    for (n = 0; n < RECLAIM_BATCH && block >= 0; n++) {
+        int next = fat_read(block);
+        if (next == FAT_ERROR || fat_write(block, FREE) == -1) {
+            fs->reclaim[0] = block;
+            return -1;
+        }
+        block = next;
+    }
+
+    // keep the rest of the chain at the front of the list, or drop it once freed
+    if (block >= 0) {
+        fs->reclaim[0] = block;
+    } else {
+        fs->reclaim_len--;
+        memmove(fs->reclaim, fs->reclaim + 1, fs->reclaim_len * sizeof(int));
+    }
+    return 0;
+}
+
+// give back up to RECLAIM_BATCH blocks of the run the defragmenter dropped, with fat_lock
+// held; only blocks still reserved are freed, as the rest went back with a freed chain or
+// were never reserved. returns -1 on a FAT error
+static int reclaim_run_batch() {
+    int n;
+    for (n = 0; n < RECLAIM_BATCH && reclaim_run_start < reclaim_run_end; n++) {
+        int value = fat_read(reclaim_run_start);
+        if (value == FAT_ERROR || (value == RESERVED && fat_write(reclaim_run_start, FREE) == -1)) {
+            return -1;
+        }
+        reclaim_run_start++;
+    }
+    return 0;
+}
+
+// free queued chains, and any run the defragmenter dropped, in batches until told to stop;
+// after a FAT error it only waits to be stopped, so allocations stop waiting for blocks it
+// will not free
+static void *reclaim_worker(void *arg) {
+    pthread_mutex_lock(&fat_lock);
+    while (1) {
+        while (((fs->reclaim_len == 0 && reclaim_run_start == reclaim_run_end) || reclaim_failed) &&
+               !reclaim_stop) {
+            pthread_cond_wait(&reclaim_work, &fat_lock);
+        }
+        if (reclaim_stop) {
+            break;
+        }
+        int status = reclaim_run_start < reclaim_run_end ? reclaim_run_batch() : reclaim_batch();
+        if (status == -1) {
+            reclaim_failed = 1;
+        }
+        pthread_cond_broadcast(&reclaim_done);
+
+        // let file operations at the FAT between batches
+        pthread_mutex_unlock(&fat_lock);
+        sched_yield();
+        pthread_mutex_lock(&fat_lock);
+    }
+    pthread_mutex_unlock(&fat_lock);
+    return NULL;
+}
+
+// queue a chain to be freed in the background; the list lives in the super block,
+// so chains still queued at umount are freed after the next mount. returns -1 if the
+// list is full and the worker has stopped on a FAT error
+static int reclaim_push(int head) {
+    pthread_mutex_lock(&fat_lock);
+    while (fs->reclaim_len == RECLAIM_MAX && !reclaim_failed) {
+        pthread_cond_wait(&reclaim_done, &fat_lock);
+    }
+    if (fs->reclaim_len == RECLAIM_MAX) {
+        pthread_mutex_unlock(&fat_lock);
+        return -1;
+    }
+    fs->reclaim[fs->reclaim_len++] = head;
+    pthread_cond_signal(&reclaim_work);
+    pthread_mutex_unlock(&fat_lock);
+    return 0;
+}
+
+// hand the blocks [start, end) held for a dropped relocation to the worker to give back,
+// so dropping a plan costs the caller nothing however long the file is. The run is not
+// recorded on disk: fs_sync gives back what is left before writing the FAT
+static void reclaim_run(int start, int end) {
+    pthread_mutex_lock(&fat_lock);
+    reclaim_run_start = start;
+    reclaim_run_end = end;
+    pthread_cond_signal(&reclaim_work);
+    pthread_mutex_unlock(&fat_lock);
+}
+
+// returns 1 while blocks of a dropped relocation are waiting to be given back, 0 once they
+// all are and -1 if the worker has stopped on a FAT error before freeing them
+static int reclaim_run_pending() {
+    pthread_mutex_lock(&fat_lock);
+    int pending = reclaim_run_start < reclaim_run_end ? (reclaim_failed ? -1 : 1) : 0;
+    pthread_mutex_unlock(&fat_lock);
+    return pending;
+}
+
+static int reclaim_start() {
+    reclaim_stop = 0;
+    reclaim_failed = 0;
+    if (pthread_create(&reclaim_thread, NULL, reclaim_worker, NULL) != 0) {
+        return -1;
+    }
+    reclaim_running = 1;
+    return 0;
+}
+
+static void reclaim_end() {
+    if (!reclaim_running) {
+        return;
+    }
+    pthread_mutex_lock(&fat_lock);
+    reclaim_stop = 1;
+    pthread_cond_signal(&reclaim_work);
+    pthread_mutex_unlock(&fat_lock);
+    pthread_join(reclaim_thread, NULL);
+    reclaim_running = 0;
+}
+
 // create a fresh (and empty) file system on the virtual disk
 int make_fs(char* disk_name) {
+    return make_fs_sized(disk_name, DISK_BLOCKS);
+}
+
+// set the most FAT blocks kept in memory while mounted; takes effect at the next mount
+static int do_fat_budget(int pages) {
+    if (pages < 1) {
+        return -1;
+    }
+    fat_budget = pages;
+    return 0;
+}
+
+// create a fresh file system on a virtual disk of nblocks blocks
+static int do_make_fs(char* disk_name, int nblocks) {
+    // check if mounted
+    if (mounted) {
+        return -1;
+    }
+
     // make and open virtual disk, return -1 on error
-    if(make_disk(disk_name) == -1){
+    if(make_disk_sized(disk_name, nblocks) == -1){
         return -1;
     }
     if(open_disk(disk_name) == -1){
         return -1;
     }
 
+    alloc_metadata();
+
     // initialize superblock
-    fs = calloc(1, sizeof(struct super_block));
+    memset(fs, 0, BLOCK_SIZE);
+    fs->nblocks = disk_blocks();
+    fs->fat_width = fat_width(fs->nblocks);
     fs->fat_idx = 1;    
-    fs->fat_len = 4;
+    fs->fat_len = fat_blocks(fs->nblocks);
     fs->dir_idx = fs->fat_len + fs->fat_idx;
     fs->dir_len = 1;    
     fs->data_idx = fs->dir_len + fs->dir_idx;
 
-    // initialize file allocation table
-    FAT = calloc(DISK_BLOCKS, sizeof(int));
-    int i;
-
-    for (i = 0; i < DISK_BLOCKS; i++) {
-        FAT[i] = FREE;
+    // disk too small to hold any data
+    if (fs->data_idx >= fs->nblocks) {
+        close_disk();
+        return -1;
     }
+
+    // initialize file allocation table; FREE entries are all ones at either width
+    char blocks[BLOCK_SIZE];
+    memset(blocks, 0xff, BLOCK_SIZE);
+    int i;
     for (i = 0; i < (fs->fat_len); i++) {
-        if (block_write(i + fs->fat_idx, (char *) (FAT + i *  BLOCK_SIZE)) == -1) {
+        if (block_write(i + fs->fat_idx, blocks) == -1) {
+            close_disk();
             return -1;
         }
     }
     
     // initialize directory table
-    DIR = calloc(MAX_FILES_ALLOWED, sizeof(struct dir_entry));
+    memset(DIR, 0, BLOCK_SIZE);
+    file_counter = 0;
     if (block_write(0, (char*) fs) == -1) {
         return -1;
     }
@@ -102,9 +616,9 @@ int make_fs(char* disk_name) {
 }
 
 // mount file system stored on virtual disk
-int mount_fs(char *disk_name) {
+static int do_mount(char *disk_name) {
     // check if disk is available to mount
-    if (mounted || !validfs) {
+    if (mounted) {
         return -1;
     }
 
@@ -113,70 +627,142 @@ int mount_fs(char *disk_name) {
         return -1;
     }
 
+    // the volume may have been made by another process
+    alloc_metadata();
+
     // read super block info
     if (block_read(0, (char*) fs) == -1) {
+        close_disk();
         return -1;
     }   
 
-    // read FAT info
-    int i;
-    for (i = 0; i < (fs->fat_len); i++) {
-        if (block_read(i + fs->fat_idx, (char*) (FAT + i * BLOCK_SIZE)) == -1) {
-            return -1;
-        }
+    // check that the disk holds a file system with the expected layout
+    if (fs->nblocks < 1 || fs->nblocks > disk_blocks() ||
+        fs->fat_width != fat_width(fs->nblocks) || fs->fat_idx != 1 ||
+        fs->fat_len != fat_blocks(fs->nblocks) ||
+        fs->dir_idx != fs->fat_idx + fs->fat_len || fs->data_idx != fs->dir_idx + 1 ||
+        fs->reclaim_len < 0 || fs->reclaim_len > RECLAIM_MAX) {
+        close_disk();
+        return -1;
     }
+    validfs = 1;
 
     // read directory info
     if (block_read(fs->dir_idx, (char*) DIR) == -1) {
+        close_disk();
+        return -1;
+    }
+
+    // FAT blocks are read as they are first used
+    if (fat_open() == -1) {
+        close_disk();
+        return -1;
+    }
+
+    // carry on freeing chains left queued at the last umount
+    reclaim_run_start = 0;
+    reclaim_run_end = 0;
+    if (reclaim_start() == -1) {
+        fat_close();
+        close_disk();
         return -1;
     }
 
-    // initialize reference count of file descriptor entries
+    int i;
+
+    // initialize reference count of file descriptor entries and count files
+    file_counter = 0;
     for (i = 0; i < MAX_FILES_ALLOWED; i++) {
         DIR[i].ref_cnt = 0;
+        if (DIR[i].used) {
+            file_counter++;
+        }
     }
 
-    // initialize file descriptors
-    for (i = 0; i < MAX_FILDES; i++) {
-        fildes_array[i].used = 0;
-        fildes_array[i].file = FREE;
-		fildes_array[i].offset = 0;
-    }
+    // a snapshot of the disk first writes back what is cached here
+    disk_set_flush(fs_sync);
 
     mounted = 1;
     return 0;
 }
 
+// write index blocks, super block, FAT and directory cached in memory back to the disk,
+// so the image on disk is a complete volume
+static int fs_sync() {
+    int status = 0;
+    int i;
+
+    // blocks held for a relocation would stay reserved in a copy of the image
+    defrag_release();
+
+    // cached index blocks
+    for (i = 0; i < MAX_FILES_ALLOWED; i++) {
+        struct open_file *file = atomic_load(&open_files[i]);
+        if (file && leaf_flush(file) == -1) {
+            status = -1;
+        }
+    }
+
+    // super block and FAT, kept consistent with each other by fat_lock (the reclaim
+    // worker changes both); blocks the relocation held that the worker has not yet
+    // given back are freed here first
+    pthread_mutex_lock(&fat_lock);
+    while (reclaim_run_start < reclaim_run_end && status == 0) {
+        status = reclaim_run_batch();
+    }
+    if (block_write(0, (char*) fs) == -1 || fat_flush() == -1) {
+        status = -1;
+    }
+    pthread_mutex_unlock(&fat_lock);
+
+    // directory
+    if (block_write(fs->dir_idx, (char*) DIR) == -1) {
+        status = -1;
+    }
+
+    return status;
+}
+
 // unmounts file system from virtual disk
-int umount_fs(char *disk_name) {
+static int do_umount(char *disk_name) {
     // check if mounted
     if (!mounted) {
         return -1;
     }
-
-    // write super block info
-    if (block_write(0, (char*) fs) == -1) {
-        return -1;
-    }
-    
-    // write FAT info
     int i;
-    for (i = 0; i < (fs->fat_len); i++) {
-        if (block_write(i + (fs->fat_idx), (char*) (FAT + i * BLOCK_SIZE))) {
-            return -1;
-        }
-    }
 
-    // write directory info
-    if (block_write(fs->dir_idx, (char*) DIR) == -1) {
+    // give back any blocks held for an unfinished defragmentation run
+    defrag_end();
+
+    // chains not yet freed stay queued in the super block
+    reclaim_end();
+
+    // write back everything cached; the file system stays mounted if that fails, so the
+    // worker is started again, or if it cannot be, allocations are told not to wait for it
+    if (fs_sync() == -1) {
+        if (reclaim_start() == -1) {
+            pthread_mutex_lock(&fat_lock);
+            reclaim_failed = 1;
+            pthread_cond_broadcast(&reclaim_done);
+            pthread_mutex_unlock(&fat_lock);
+        }
         return -1;
     }
+    fat_close();
 
     // file descripters no longer meaningful after umount
-    for (i = 0; i < MAX_FILDES; i++) {
-        fildes_array[i].used = 0;
-        fildes_array[i].file = FREE;
-        fildes_array[i].offset = 0;
+    for (i = 0; i < atomic_load(&fildes_chunks); i++) {
+        free(fildes_table[i]);
+        fildes_table[i] = NULL;
+    }
+    atomic_store(&fildes_chunks, 0);
+    atomic_store(&fildes_free, 0);
+    for (i = 0; i < MAX_FILES_ALLOWED; i++) {
+        struct open_file *file = atomic_exchange(&open_files[i], NULL);
+        if (file) {
+            free(file->leaf_data);
+            free(file);
+        }
     }
 
     // close disk
@@ -190,97 +776,378 @@ int umount_fs(char *disk_name) {
     return 0;
 }
 
-// open file for reading and writing
-int fs_open(char *name) {
-    // return if no files exist
-    if (file_counter == 0) {
-        return -1;
-    }
-
-    int i;
-    for (i = 0; i < MAX_FILES_ALLOWED; i++) {
-        // check if file exists
-        if (strcmp(DIR[i].name, name) == 0) {
-            break;
-        }
-        // check if multiple files reached
-        if (i >= MAX_FILES_ALLOWED - 1) {
-            return -1;
-        }
-    }
+static struct file_descriptor *fildes_at(int fildes) {
+    return &fildes_table[fildes / FILDES_CHUNK][fildes % FILDES_CHUNK];
+}
 
-    // find available file descriptor to assign to file
-    int j;
-    for (j = 0; j < MAX_FILDES; j++) {
-        if (fildes_array[j].used == 0) {
-            fildes_array[j].used = 1;
-            fildes_array[j].file = DIR[i].head;
-            fildes_array[j].offset = 0;
-            DIR[i].ref_cnt++;
-            return j;
-        }
+// look up an open file descriptor, NULL if fildes is out of range or not open
+static struct file_descriptor *fildes_get(int fildes) {
+    if (fildes < 0 || fildes >= atomic_load(&fildes_chunks) * FILDES_CHUNK) {
+        return NULL;
     }
+    struct file_descriptor *fd = fildes_at(fildes);
+    return fd->file ? fd : NULL;
+}
 
-    // return error if no available descriptors
-    return -1;
+// push descriptors first..last, already linked through next_free, onto the free list
+static void fildes_push(int first, int last) {
+    uint64_t head = atomic_load(&fildes_free);
+    uint64_t next;
+    do {
+        atomic_store_explicit(&fildes_at(last)->next_free, (int) (head & 0xffffffff) - 1, memory_order_relaxed);
+        next = ((head >> 32) + 1) << 32 | (uint32_t) (first + 1);
+    } while (!atomic_compare_exchange_weak(&fildes_free, &head, next));
 }
 
-// close file specified by file descriptor
-int fs_close(int fildes) {
-    if (fildes >= MAX_FILDES || fildes < 0) {
-        return -1;
-    }
+// add a chunk of descriptors to the table and the free list
+static int fildes_grow_table() {
+    pthread_mutex_lock(&fildes_grow);
 
-    // locate file
-    int i;
-    for (i = 0; i < MAX_FILES_ALLOWED; i++) {
-        if (DIR[i].head == fildes_array[fildes].file && fildes_array[fildes].used) {
-            DIR[i].ref_cnt--;
-            fildes_array[fildes].used = 0;
-            fildes_array[fildes].file = FREE;
-            fildes_array[fildes].offset = 0;
-            return 0;
-        }
+    // another thread may have grown the table while this one waited
+    if (atomic_load(&fildes_free) & 0xffffffff) {
+        pthread_mutex_unlock(&fildes_grow);
+        return 0;
     }
 
-    // return error if file not found
-    return -1;
-}
-
-// create new file in root directory
-int fs_create(char *name) {
-
-    // check if maximum files reached
-    if (file_counter >= MAX_FILES_ALLOWED) {
-        return -1;
+    int chunk = atomic_load(&fildes_chunks);
+    struct file_descriptor *table = NULL;
+    if (chunk < FILDES_MAX_CHUNKS) {
+        table = calloc(FILDES_CHUNK, sizeof(struct file_descriptor));
     }
-    
-    // check length of file name
-    if (strlen(name) > MAX_F_NAME) {
+    if (!table) {
+        pthread_mutex_unlock(&fildes_grow);
         return -1;
     }
 
-    // check if file already exists
+    int first = chunk * FILDES_CHUNK;
     int i;
-    for (i = 0; i < MAX_FILES_ALLOWED; i++) {
-        if (DIR[i].used && strcmp(DIR[i].name, name) == 0) {
-            return -1;
-        }
+    for (i = 0; i < FILDES_CHUNK - 1; i++) {
+        atomic_init(&table[i].next_free, first + i + 1);
     }
+    fildes_table[chunk] = table;
+    atomic_store(&fildes_chunks, chunk + 1);
+    fildes_push(first, first + FILDES_CHUNK - 1);
 
-    // locate available slot in FAT
-    for (i = fs->data_idx; i < DISK_BLOCKS; i++) {
-        if (FAT[i] == FREE) {
-            FAT[i] = END_MARKER;
-            break;
+    pthread_mutex_unlock(&fildes_grow);
+    return 0;
+}
+
+// take a descriptor off the free list; the change count in the head stops a descriptor
+// that was taken and returned in between from being mistaken for an unchanged list
+static int fildes_alloc() {
+    uint64_t head = atomic_load(&fildes_free);
+    while (1) {
+        int fildes = (int) (head & 0xffffffff) - 1;
+        if (fildes < 0) {
+            if (fildes_grow_table() == -1) {
+                return -1;
+            }
+            head = atomic_load(&fildes_free);
+            continue;
         }
-        // return error if no available slots
-        if (i >= DISK_BLOCKS) {
-            return -1;
+        // next_free may be stale if another thread took this descriptor first; the exchange then fails
+        int after = atomic_load_explicit(&fildes_at(fildes)->next_free, memory_order_relaxed);
+        uint64_t next = ((head >> 32) + 1) << 32 | (uint32_t) (after + 1);
+        if (atomic_compare_exchange_weak(&fildes_free, &head, next)) {
+            return fildes;
         }
     }
+}
 
-    // locate available slot in directory
+// find the open file of a directory entry, creating it on first open
+static struct open_file *open_file_get(int entry) {
+    struct open_file *file = atomic_load(&open_files[entry]);
+    if (file) {
+        return file;
+    }
+
+    struct open_file *fresh = calloc(1, sizeof(struct open_file));
+    if (!fresh) {
+        return NULL;
+    }
+    fresh->entry = entry;
+    fresh->map_index = -1;
+    fresh->leaf = -1;
+
+    // another thread may have created it first
+    if (atomic_compare_exchange_strong(&open_files[entry], &file, fresh)) {
+        return fresh;
+    }
+    free(fresh);
+    return file;
+}
+
+// blocks of a file moved or were freed, so its remembered position is stale
+static void map_forget(int entry) {
+    struct open_file *file = atomic_load(&open_files[entry]);
+    if (file) {
+        file->map_index = -1;
+    }
+}
+
+// the block index of a file maps logical block numbers to disk blocks: index blocks at the
+// bottom level hold block numbers, those above hold index blocks, and the FAT chain stays the
+// record of which blocks the file owns
+
+// logical blocks an index of the given depth can map
+static int64_t index_capacity(int depth) {
+    int64_t capacity = 1;
+    while (depth-- > 0) {
+        capacity *= INDEX_FANOUT;
+    }
+    return capacity;
+}
+
+// write back the index block cached by an open file
+static int leaf_flush(struct open_file *file) {
+    if (file->leaf >= 0 && file->leaf_dirty) {
+        if (block_write(file->leaf, (char*) file->leaf_data) == -1) {
+            return -1;
+        }
+        file->leaf_dirty = 0;
+    }
+    return 0;
+}
+
+// bring a bottom-level index block into the open file's cache
+static int32_t *leaf_load(struct open_file *file, int leaf) {
+    if (file->leaf == leaf) {
+        return file->leaf_data;
+    }
+    if (leaf_flush(file) == -1) {
+        return NULL;
+    }
+    if (!file->leaf_data && !(file->leaf_data = malloc(BLOCK_SIZE))) {
+        return NULL;
+    }
+    file->leaf = -1;
+    if (block_read(leaf, (char*) file->leaf_data) == -1) {
+        return NULL;
+    }
+    file->leaf = leaf;
+    return file->leaf_data;
+}
+
+// allocate an index block with first in its first slot and link it into the file's index chain
+static int index_alloc(struct open_file *file, int first) {
+    struct dir_entry *entry = &DIR[file->entry];
+    int32_t node[INDEX_FANOUT];
+    int block = fat_alloc_high();
+    if (block < 0) {
+        return -1;
+    }
+    memset(node, 0xff, BLOCK_SIZE);
+    node[0] = first;
+    if (block_write(block, (char*) node) == -1 ||
+        (entry->index_chain >= 0 && fat_set(block, entry->index_chain) == -1)) {
+        fat_set(block, FREE);
+        return -1;
+    }
+    entry->index_chain = block;
+    return block;
+}
+
+// walk the upper levels of the index to the bottom-level block covering logical block index,
+// adding missing index blocks on the way when create is set
+static int index_leaf(struct open_file *file, int index, int create) {
+    struct dir_entry *entry = &DIR[file->entry];
+    int32_t node[INDEX_FANOUT];
+    int block = entry->index;
+    int level;
+    for (level = entry->depth - 1; level > 0; level--) {
+        if (block_read(block, (char*) node) == -1) {
+            return -1;
+        }
+        int slot = index / index_capacity(level) % INDEX_FANOUT;
+        if (node[slot] < 0) {
+            if (!create) {
+                return -1;
+            }
+            if ((node[slot] = index_alloc(file, -1)) == -1) {
+                return -1;
+            }
+            if (block_write(block, (char*) node) == -1) {
+                return -1;
+            }
+        }
+        block = node[slot];
+    }
+    return block;
+}
+
+// bottom-level index block covering logical block index; the upper levels are only walked
+// when the cached block covers other blocks, so appending reads no index blocks
+static int32_t *index_data(struct open_file *file, int index, int create) {
+    int base = index - index % INDEX_FANOUT;
+    if (file->leaf >= 0 && file->leaf_base == base) {
+        return file->leaf_data;
+    }
+    int leaf = index_leaf(file, index, create);
+    int32_t *data = leaf == -1 ? NULL : leaf_load(file, leaf);
+    if (data) {
+        file->leaf_base = base;
+    }
+    return data;
+}
+
+// disk block of logical block index, at most INDEX_DEPTH index reads away. Only blocks
+// within the file's size are looked up: truncate keeps the index blocks, whose entries
+// past the end still name blocks that have been freed
+static int index_get(struct open_file *file, int index) {
+    struct dir_entry *entry = &DIR[file->entry];
+    if (index == 0) {
+        return entry->head;
+    }
+    if (index >= index_capacity(entry->depth) || index >= (entry->size + BLOCK_SIZE - 1) / BLOCK_SIZE) {
+        return -1;
+    }
+    int32_t *data = index_data(file, index, 0);
+    return data ? data[index % INDEX_FANOUT] : -1;
+}
+
+// record that logical block index is stored in block, deepening the index when it is too small
+static int index_set(struct open_file *file, int index, int block) {
+    struct dir_entry *entry = &DIR[file->entry];
+    while (index >= index_capacity(entry->depth)) {
+        if (entry->depth == INDEX_DEPTH) {
+            return -1;
+        }
+        // the old root (or the head, for a file that had one block) becomes the first child
+        int root = index_alloc(file, entry->depth == 0 ? entry->head : entry->index);
+        if (root == -1) {
+            return -1;
+        }
+        entry->index = root;
+        entry->depth++;
+    }
+    if (entry->depth == 0) {
+        // the directory entry holds the only block
+        return 0;
+    }
+
+    int32_t *data = index_data(file, index, 1);
+    if (!data) {
+        return -1;
+    }
+    data[index % INDEX_FANOUT] = block;
+    file->leaf_dirty = 1;
+    return 0;
+}
+
+// find logical block index of an open file and the block before it (-1 for the first block);
+// block is END_MARKER when index is just past the end of the file. Sequential access carries
+// on from the remembered position, anything else is a lookup in the block index
+static int map_block(struct open_file *file, int index, int *block, int *prev) {
+    if (file->map_index >= 0 && file->map_index == index) {
+        *block = file->map_block;
+        *prev = file->map_prev;
+        return 0;
+    }
+    if (index == 0) {
+        *block = DIR[file->entry].head;
+        *prev = -1;
+        return 0;
+    }
+    if (file->map_index >= 0 && file->map_index == index - 1) {
+        *prev = file->map_block;
+    } else if ((*prev = index_get(file, index - 1)) < 0) {
+        return -1;
+    }
+    *block = fat_get(*prev);
+    return *block == FAT_ERROR ? -1 : 0;
+}
+
+static void map_remember(struct open_file *file, int index, int block, int prev) {
+    file->map_index = index;
+    file->map_block = block;
+    file->map_prev = prev;
+}
+
+// open file for reading and writing
+static int do_open(char *name) {
+    // opens run together, but no delete can come between finding the file and counting the descriptor
+    pthread_rwlock_rdlock(&dir_lock);
+
+    int i;
+    for (i = 0; i < MAX_FILES_ALLOWED; i++) {
+        // check if file exists
+        if (DIR[i].used && strcmp(DIR[i].name, name) == 0) {
+            break;
+        }
+    }
+    struct open_file *file = NULL;
+    if (i < MAX_FILES_ALLOWED) {
+        file = open_file_get(i);
+    }
+
+    // take an available file descriptor, return error if there are none
+    int fildes = -1;
+    if (file) {
+        fildes = fildes_alloc();
+    }
+    if (fildes != -1) {
+        struct file_descriptor *fd = fildes_at(fildes);
+        fd->offset = 0;
+        atomic_fetch_add(&file->refs, 1);
+        atomic_store(&fd->file, file);
+    }
+
+    pthread_rwlock_unlock(&dir_lock);
+    return fildes;
+}
+
+// close file specified by file descriptor
+static int do_close(int fildes) {
+    struct file_descriptor *fd = fildes_get(fildes);
+    if (!fd) {
+        return -1;
+    }
+
+    // only the caller that takes the file off the descriptor frees it, so two closes
+    // of the same descriptor cannot push it twice
+    struct open_file *file = atomic_exchange(&fd->file, NULL);
+    if (!file) {
+        return -1;
+    }
+    atomic_fetch_sub(&file->refs, 1);
+    fd->offset = 0;
+    fildes_push(fildes, fildes);
+    return 0;
+}
+
+// create new file in root directory
+static int do_create(char *name) {
+
+    // check length of file name
+    if (strlen(name) > MAX_F_NAME) {
+        return -1;
+    }
+
+    pthread_rwlock_wrlock(&dir_lock);
+
+    // check if maximum files reached
+    if (file_counter >= MAX_FILES_ALLOWED) {
+        pthread_rwlock_unlock(&dir_lock);
+        return -1;
+    }
+
+    // check if file already exists
+    int i;
+    for (i = 0; i < MAX_FILES_ALLOWED; i++) {
+        if (DIR[i].used && strcmp(DIR[i].name, name) == 0) {
+            pthread_rwlock_unlock(&dir_lock);
+            return -1;
+        }
+    }
+
+    // locate available slot in FAT
+    i = fat_alloc(-1);
+    if (i < 0) {
+        pthread_rwlock_unlock(&dir_lock);
+        return -1;
+    }
+
+    // locate available slot in directory
     int j;
     for (j = 0; j < MAX_FILES_ALLOWED; j++) {
         if (!DIR[j].used) {
@@ -289,159 +1156,208 @@ int fs_create(char *name) {
             DIR[j].size = 0;
             DIR[j].head = i;
             DIR[j].ref_cnt = 0;
+            DIR[j].index = -1;
+            DIR[j].depth = 0;
+            DIR[j].index_chain = -1;
             strcpy(DIR[j].name, name);
             fs->dir_len++;
+            pthread_rwlock_unlock(&dir_lock);
             return 0;
         }
     }
 
     // return error if no available slots
+    pthread_rwlock_unlock(&dir_lock);
     return -1;
 }
 
 // delete file from root directory
-int fs_delete(char *name) {
+static int do_delete(char *name) {
     // check if name valid
     if (strlen(name) > MAX_F_NAME) {
         return -1;
     }
 
+    // no open can count a descriptor between the check below and freeing the entry
+    pthread_rwlock_wrlock(&dir_lock);
+
     // locate file
     int i;
     for (i = 0; i < MAX_FILES_ALLOWED; i++) {
-        // check name and reference counter (can not delete if reference counter < 0)
-        if (strcmp(DIR[i].name, name) == 0 && DIR[i].ref_cnt == 0) {
-            int next;
-            int block = DIR[i].head;
-            while (FAT[DIR[i].head] != FREE) {
-                next = FAT[block];
-                FAT[block] = FREE;
-                if (next == END_MARKER) {
-                    break;
-                }
-                block = next;
+        // check name and open descriptors (can not delete while the file is open)
+        struct open_file *file = atomic_load(&open_files[i]);
+        if (DIR[i].used && strcmp(DIR[i].name, name) == 0 && (!file || atomic_load(&file->refs) == 0)) {
+            // stop relocating the file if the defragmenter is working on it
+            if (defrag.entry == i) {
+                defrag_release();
+            }
+
+            // drop the cached index block before it can be reused
+            if (file) {
+                file->leaf = -1;
+                file->leaf_dirty = 0;
+            }
+
+            // blocks are freed in the background; with the reclaim worker stopped on
+            // an error they stay allocated
+            int status = 0;
+            if (reclaim_push(DIR[i].head) == -1 ||
+                (DIR[i].index_chain >= 0 && reclaim_push(DIR[i].index_chain) == -1)) {
+                status = -1;
             }
+
             // update directory entry
+            map_forget(i);
             DIR[i].used = 0;
             DIR[i].size = 0;
             DIR[i].head = FREE;
+            DIR[i].index = -1;
+            DIR[i].depth = 0;
+            DIR[i].index_chain = -1;
             memset(DIR[i].name, '\0', strlen(DIR[i].name));
 
             // update directory length and file counter
             fs->dir_len--;
             file_counter--;
-            return 0;
+            pthread_rwlock_unlock(&dir_lock);
+            return status;
         }
     }
 
     // return error if file not found
+    pthread_rwlock_unlock(&dir_lock);
     return -1;
 }
 
 // read nbytes of data into buffer
-int fs_read(int fildes, void *buf, size_t nbyte) {
-    // check if file descriptor and nbyte input are valid    
-    if (fildes > MAX_FILDES || fildes < 0 || nbyte < 0) {
-        return -1;
-    }
-    if (!fildes_array[fildes].used) {
+static ssize_t do_read(int fildes, void *buf, size_t nbyte) {
+    // check if file descriptor is valid    
+    struct file_descriptor *fd = fildes_get(fildes);
+    if (!fd) {
         return -1;
     }
     if (nbyte == 0) {
         return 0;
     }
-
-    // locate file
-    int entry;
-    for (entry = 0; entry < MAX_FILES_ALLOWED; entry++) {
-        if (fildes_array[fildes].file == DIR[entry].head) {
-            break;
-        }
-        // return error if file not found
-        if (entry >= MAX_FILES_ALLOWED - 1) {
-            return -1;
-        }
-    }
+    struct open_file *file = fd->file;
+    struct dir_entry *entry = &DIR[file->entry];
 
     // update bytes to read if needed
-    if (nbyte + fildes_array[fildes].offset > DIR[entry].size) {
-        nbyte = DIR[entry].size - fildes_array[fildes].offset;
+    if (fd->offset >= entry->size) {
+        return 0;
+    }
+    if (nbyte > (uint64_t) (entry->size - fd->offset)) {
+        nbyte = entry->size - fd->offset;
+    }
+    if (nbyte > SSIZE_MAX) {
+        nbyte = SSIZE_MAX;
     }
 
-    // allocate character buffers
     char blocks[BLOCK_SIZE];
-    memset(blocks, FREE, BLOCK_SIZE);
-    char* buffer = (char *) calloc(1, nbyte * sizeof(char));
-    memset(buffer, 0, nbyte);
-    int offset = fildes_array[fildes].offset;
-    int block = fildes_array[fildes].file;
+    char *dest = (char *) buf;
+    size_t remaining = nbyte;
+    int offset = fd->offset % BLOCK_SIZE;
+    int index = fd->offset / BLOCK_SIZE;
 
     // go to first block
-	while(offset >= BLOCK_SIZE){
-		offset -= BLOCK_SIZE;
-		block = FAT[block];
-	}
+    int prev;
+    int block;
+    if (map_block(file, index, &block, &prev) == -1) {
+        return -1;
+    }
 
-    int remaining = nbyte;
-    int reading = 0;
     while (remaining > 0) {
-        // read into buffer
-        block_read(block, blocks);
-        int i;
-        for (i = offset; i < BLOCK_SIZE; i++) {
-            buffer[reading] = blocks[i];
-            reading++;
-            remaining--;
-            // stop loop once all bytes read
-            if (!remaining) {
-                break;
+        int count = 1;
+        if (offset > 0 || remaining < BLOCK_SIZE) {
+            // partial block: read through block buffer
+            size_t n = BLOCK_SIZE - offset;
+            if (n > remaining) {
+                n = remaining;
+            }
+            if (block_read(block, blocks) == -1) {
+                return -1;
             }
+            memcpy(dest, blocks + offset, n);
+            dest += n;
+            remaining -= n;
+            fd->offset += n;
+        } else {
+            // whole blocks: read each physically contiguous run straight into buffer
+            int first = block;
+            while ((size_t) (count + 1) * BLOCK_SIZE <= remaining && fat_get(block) == block + 1) {
+                prev = block;
+                block++;
+                count++;
+            }
+            if (block_read_n(first, count, dest) == -1) {
+                return -1;
+            }
+            dest += (size_t) count * BLOCK_SIZE;
+            remaining -= (size_t) count * BLOCK_SIZE;
+            fd->offset += (off_t) count * BLOCK_SIZE;
         }
-        // go to next block if still reading
-        if (remaining) {
-            block = FAT[block];
-            offset = 0;
+
+        // the next sequential call starts from the last block read
+        map_remember(file, index + count - 1, block, prev);
+        prev = block;
+        if ((block = fat_get(block)) == FAT_ERROR) {
+            return -1;
         }
+        index += count;
+        offset = 0;
     }
 
-    // copy into input buffer
-    memcpy(buf, buffer, nbyte);
-    
     // return number of bytes read
     return nbyte;
 }
 
-// write nbytes of data from buffer
-int fs_write(int fildes, void *buf, size_t nbyte) {
-    int bytes_written = 0;
-    int remaining;
-
-    // check if file descriptor and nbyte input are valid
-    if (fildes > MAX_FILDES || fildes < 0 || nbyte < 0) {
+// allocate logical block index after prev at the end of a file, preferring the block that
+// follows prev on disk, and record it in the file's block index
+// returns -1 when the disk is full and FAT_ERROR when the FAT can not be read or written
+static int file_extend(struct open_file *file, int prev, int index) {
+    int j = fat_alloc(prev);
+    if (j < 0) {
+        return j;
+    }
+    if (index_set(file, index, j) == -1) {
+        fat_set(j, FREE);
         return -1;
     }
-    if (!fildes_array[fildes].used) {
+    if (fat_set(prev, j) == -1) {
+        fat_set(j, FREE);
+        return FAT_ERROR;
+    }
+    return j;
+}
+
+// write nbytes of data from buffer
+static ssize_t do_write(int fildes, void *buf, size_t nbyte) {
+    ssize_t bytes_written = 0;
+    size_t remaining;
+
+    // check if file descriptor is valid
+    struct file_descriptor *fd = fildes_get(fildes);
+    if (!fd) {
         return -1;
     }
     if (nbyte == 0) {
         return 0;
     }
+    struct open_file *file = fd->file;
+    struct dir_entry *entry = &DIR[file->entry];
 
-    // locate file
-    int entry;
-    for (entry = 0; entry < MAX_FILES_ALLOWED; entry++) {
-        if (fildes_array[fildes].file == DIR[entry].head) {
-            break;
-        }
-        // return error if file not found
-        if (entry >= MAX_FILES_ALLOWED - 1) {
-            return -1;
-        }
+    // another descriptor may have truncated the file below this one's offset; write at
+    // the end instead of past it
+    if (fd->offset > entry->size) {
+        fd->offset = entry->size;
     }
 
-    // if read will exceed storage space --> update nbyte
-    if (nbyte + fildes_array[fildes].offset > STORAGE) {
-        nbyte = STORAGE - fildes_array[fildes].offset;
+    // if write will exceed storage space --> update nbyte
+    if (nbyte > (uint64_t) (STORAGE - fd->offset)) {
+        nbyte = STORAGE - fd->offset;
+    }
+    if (nbyte > SSIZE_MAX) {
+        nbyte = SSIZE_MAX;
     }
 
     // bytes to write
@@ -449,68 +1365,85 @@ int fs_write(int fildes, void *buf, size_t nbyte) {
 
     // allocate buffers
     char blocks[BLOCK_SIZE];
-    memset(blocks, FREE, BLOCK_SIZE);
+    char *src = (char *) buf;
+    int offset = fd->offset % BLOCK_SIZE;
+    int index = fd->offset / BLOCK_SIZE;
 
-    int block = fildes_array[fildes].file;
-    int prev = 0;
-    int offset = fildes_array[fildes].offset;
-    while (offset >= BLOCK_SIZE) {
-        offset -= BLOCK_SIZE;
-        prev = block;
-        block = FAT[block];
+    // go to first block
+    int prev;
+    int block;
+    if (map_block(file, index, &block, &prev) == -1) {
+        return -1;
     }
 
     while (remaining > 0) {
-        // update eof marker
+        // update eof marker, stop early if the disk is full
         if (block == END_MARKER) {
-            int j;
-            for (j = fs->data_idx; j < DISK_BLOCKS; j++) {
-                if (FAT[j] == FREE) {
-                    FAT[j] = END_MARKER;
-                    FAT[prev] = j;
-                    block = FAT[prev];
-                    break;
-                }
+            block = file_extend(file, prev, index);
+            if (block == -1) {
+                break;
+            }
+            if (block == FAT_ERROR) {
+                return -1;
             }
         }
 
-        if (block_read(block, blocks) == -1) {
-            return -1;
-        }
-
-        // write to buffer
-        int i;
-        for (i = offset; i < BLOCK_SIZE; i++) {
-            blocks[i] = *((char *) buf + bytes_written);
-            bytes_written++;
-            fildes_array[fildes].offset++;
-            remaining--;
-            if (!remaining) {
-                break;
+        int count = 1;
+        if (offset > 0 || remaining < BLOCK_SIZE) {
+            // partial block: merge with what is already on disk
+            size_t n = BLOCK_SIZE - offset;
+            if (n > remaining) {
+                n = remaining;
             }
-            if (i + offset > STORAGE) {
-                return bytes_written;
+            if (block_read(block, blocks) == -1) {
+                return -1;
             }
-        }
-        // go to next block if still writing
-        if (remaining) {
+            memcpy(blocks + offset, src, n);
             if (block_write(block, blocks) == -1) {
                 return -1;
             }
-            prev = block;
-            block = FAT[block];
-            offset = 0;
+            src += n;
+            remaining -= n;
+            bytes_written += n;
+            fd->offset += n;
+        } else {
+            // whole blocks: gather a physically contiguous run, extending the file as needed,
+            // and write it straight from the buffer
+            int first = block;
+            while ((size_t) (count + 1) * BLOCK_SIZE <= remaining) {
+                int next = fat_get(block);
+                if (next == END_MARKER) {
+                    next = file_extend(file, block, index + count);
+                }
+                if (next != block + 1) {
+                    break;
+                }
+                prev = block;
+                block = next;
+                count++;
+            }
+            if (block_write_n(first, count, src) == -1) {
+                return -1;
+            }
+            src += (size_t) count * BLOCK_SIZE;
+            remaining -= (size_t) count * BLOCK_SIZE;
+            bytes_written += (ssize_t) count * BLOCK_SIZE;
+            fd->offset += (off_t) count * BLOCK_SIZE;
         }
-    }
 
-    // load block
-    if (block_write(block, blocks) == -1) {
-        return -1;
+        // the next sequential call starts from the last block written
+        map_remember(file, index + count - 1, block, prev);
+        prev = block;
+        if ((block = fat_get(block)) == FAT_ERROR) {
+            return -1;
+        }
+        index += count;
+        offset = 0;
     }
 
     // update file size
-    if (DIR[entry].size < fildes_array[fildes].offset) {
-        DIR[entry].size = fildes_array[fildes].offset;
+    if (entry->size < fd->offset) {
+        entry->size = fd->offset;
     }   
 
     // return number of bytes written
@@ -518,29 +1451,18 @@ int fs_write(int fildes, void *buf, size_t nbyte) {
 }
 
 // return current size of file
-int fs_get_filesize(int fildes) {
-    // out of range
-    if (fildes >= MAX_FILDES || fildes < 0) {
+static off_t do_get_filesize(int fildes) {
+    struct file_descriptor *fd = fildes_get(fildes);
+    if (!fd) {
         return -1;
     }
-
-    int i;
-    for (i = 0; i < MAX_FILES_ALLOWED; i++) {
-        if (DIR[i].head == fildes_array[fildes].file) {
-            if (!fildes_array[fildes].used) {
-                return -1;
-            }
-            return DIR[i].size;
-        }
-    }
-
-    return -1;
+    return DIR[fd->file->entry].size;
 }
 
 // creates and populates array of file names currently known to file system
-int fs_listfiles(char ***files) {
-    // allocate new list
-    char** list = calloc(MAX_FILES_ALLOWED, sizeof(char*));
+static int do_listfiles(char ***files) {
+    // allocate new list, with room for the terminator when every entry is used
+    char** list = calloc(MAX_FILES_ALLOWED + 1, sizeof(char*));
 
     // locate in-use entries
     int i;
@@ -562,85 +1484,991 @@ int fs_listfiles(char ***files) {
 }
 
 // sets file pointer (offset used for read and write operations)
-int fs_lseek(int fildes, off_t offset) {
-    int file_size = fs_get_filesize(fildes);
-
-    // out of range
-    if (offset > file_size || offset < 0) {
-        return -1;
-    }
-
+static int do_lseek(int fildes, off_t offset) {
     // invalid fildes
-    if (fildes > MAX_FILDES || fildes < 0) { 
+    struct file_descriptor *fd = fildes_get(fildes);
+    if (!fd) {
         return -1;
     }
 
-    // invalid fildes
-    if (!fildes_array[fildes].used) {
+    // out of range
+    if (offset > DIR[fd->file->entry].size || offset < 0) {
         return -1;
     }
     
     // update offset
-    fildes_array[fildes].offset = offset;
+    fd->offset = offset;
 
     return 0;
 }
 
 // truncate file to (length) bytes in size
-int fs_truncate(int fildes, off_t length) {
+static int do_truncate(int fildes, off_t length) {
     // out of range
-    if (fildes >= MAX_FILDES || fildes < 0 || length > STORAGE || length < 0) {
+    if (length > STORAGE || length < 0) {
         return -1;
     }
 
     // file descriptor not in use
-    if (!fildes_array[fildes].used) {
+    struct file_descriptor *fd = fildes_get(fildes);
+    if (!fd) {
         return -1;
     }
 
-    int i;
-    for (i = 0; i < MAX_FILES_ALLOWED; i++) {
-        // locate directory entry
-        if (DIR[i].head == fildes_array[fildes].file) {
+    // locate directory entry
+    int i = fd->file->entry;
 
-            // check if entry size already smaller than truncation length
-            if (DIR[i].size < length) {
-                return -1;
-            }
-            // if entry size same as truncation length --> do nothing
-            else if (DIR[i].size == length) {
-                return 0;
-            }
+    // check if entry size already smaller than truncation length
+    if (DIR[i].size < length) {
+        return -1;
+    }
+    // if entry size same as truncation length --> do nothing
+    else if (DIR[i].size == length) {
+        return 0;
+    }
 
-            // update file descriptor offset
-            if (fildes_array[fildes].offset > length) {
-                fildes_array[fildes].offset = length;
-            }
+    // the defragmenter's plan for the file no longer matches its chain
+    if (defrag.entry == i) {
+        defrag_release();
+    }
 
-            // go to new boundary block
-            int block = DIR[i].head;
-            int j;
-            for (j = 0; j < length / BLOCK_SIZE; j++) {
-                block = FAT[block];
-            }
-            int last = block;
-            int traverse = FAT[block];
+    // update file descriptor offset
+    if (fd->offset > length) {
+        fd->offset = length;
+    }
 
-            // free truncated blocks
-            while (traverse > 0) {
-                traverse = FAT[traverse];
-                FAT[traverse] = FREE;
-            }
+    // go to last block kept (a file always keeps its first block); index blocks are kept
+    // for when the file grows again
+    int keep = (length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    int block = index_get(fd->file, keep > 1 ? keep - 1 : 0);
+    if (block < 0) {
+        return -1;
+    }
 
-            // mark end
-            FAT[last] = END_MARKER;
+    // cut the chain and free the rest in the background
+    int rest = fat_get(block);
+    if (rest == FAT_ERROR || fat_set(block, END_MARKER) == -1) {
+        return -1;
+    }
+    map_forget(i);
 
-            // update entry size
-            DIR[i].size = length;
-            
-            return 0;
+    // update entry size
+    DIR[i].size = length;
+
+    // with the reclaim worker stopped on an error the cut-off blocks stay allocated
+    if (rest >= 0 && reclaim_push(rest) == -1) {
+        return -1;
+    }
+    
+    return 0;
+}
+
+// count the blocks in a FAT chain, -1 on a FAT error
+static int chain_length(int head) {
+    int length = 1;
+    int next;
+    while ((next = fat_get(head)) >= 0) {
+        head = next;
+        length++;
+    }
+    return next == FAT_ERROR ? -1 : length;
+}
+
+// count the contiguous runs of blocks in a FAT chain, -1 on a FAT error
+static int chain_extents(int head) {
+    int extents = 1;
+    int next;
+    while ((next = fat_get(head)) >= 0) {
+        if (next != head + 1) {
+            extents++;
         }
+        head = next;
     }
+    return next == FAT_ERROR ? -1 : extents;
+}
 
-    return -1;   
+// report how scattered files and free space are on disk
+static int do_frag_stats(struct fs_frag_stats *stats) {
+    if (!mounted || !stats) {
+        return -1;
+    }
+    memset(stats, 0, sizeof(struct fs_frag_stats));
+
+    // files
+    int i;
+    for (i = 0; i < MAX_FILES_ALLOWED; i++) {
+        if (DIR[i].used) {
+            int extents = chain_extents(DIR[i].head);
+            int length = chain_length(DIR[i].head);
+            if (extents == -1 || length == -1) {
+                return -1;
+            }
+            if (DIR[i].index_chain >= 0) {
+                int index_blocks = chain_length(DIR[i].index_chain);
+                if (index_blocks == -1) {
+                    return -1;
+                }
+                stats->index_blocks += index_blocks;
+            }
+            stats->files++;
+            stats->blocks += length;
+            stats->extents += extents;
+            if (extents > 1) {
+                stats->fragmented++;
+            }
+        }
+    }
+
+    // free space
+    int run = 0;
+    for (i = fs->data_idx; i < fs->nblocks; i++) {
+        int value = fat_get(i);
+        if (value == FAT_ERROR) {
+            return -1;
+        }
+        if (value == FREE) {
+            if (run == 0) {
+                stats->free_extents++;
+            }
+            run++;
+            stats->free_blocks++;
+            if (run > stats->largest_free) {
+                stats->largest_free = run;
+            }
+        } else {
+            run = 0;
+        }
+    }
+
+    return 0;
+}
+
+// return the number of contiguous runs of blocks holding a file
+static int do_file_extents(char *name) {
+    if (!mounted) {
+        return -1;
+    }
+
+    int i;
+    for (i = 0; i < MAX_FILES_ALLOWED; i++) {
+        if (DIR[i].used && strcmp(DIR[i].name, name) == 0) {
+            return chain_extents(DIR[i].head);
+        }
+    }
+
+    return -1;
+}
+
+// position within the file being relocated of one of its blocks, -1 if block is not one of them
+static int defrag_owned(int block) {
+    int low = 0;
+    int high = defrag.length - 1;
+    while (low <= high) {
+        int middle = (low + high) / 2;
+        if (defrag.blocks[middle].block == block) {
+            return defrag.blocks[middle].index;
+        }
+        if (defrag.blocks[middle].block < block) {
+            low = middle + 1;
+        } else {
+            high = middle - 1;
+        }
+    }
+    return -1;
+}
+
+// hand back the blocks reserved in [target, end) that are still unused
+static void defrag_unreserve(int end) {
+    int block;
+    for (block = defrag.target; block < end && block < fs->nblocks; block++) {
+        if (fat_get(block) == RESERVED) {
+            fat_set(block, FREE);
+        }
+    }
+}
+
+// hand unused relocation targets back to the allocator and finish with the current file;
+// as this is called from fs_delete and fs_truncate, the reserved blocks are given back by the
+// reclaim worker and the lists are kept for the next file. The blocks before target + moved
+// hold the file's moved blocks
+static void defrag_release() {
+    if (defrag.entry < 0) {
+        return;
+    }
+
+    if (defrag.step == DEFRAG_SEARCH && defrag.probe > defrag.target) {
+        reclaim_run(defrag.target, defrag.probe);
+    } else if (defrag.step == DEFRAG_MOVE && defrag.moved < defrag.length) {
+        reclaim_run(defrag.target + defrag.moved, defrag.target + defrag.length);
+    }
+    defrag.entry = -1;
+    defrag.step = DEFRAG_PICK;
+}
+
+// stop the run, freeing the lists of blocks
+static void defrag_end() {
+    defrag_release();
+    free(defrag.blocks);
+    free(defrag.sorted);
+    free(defrag.nodes);
+    defrag.blocks = NULL;
+    defrag.sorted = NULL;
+    defrag.nodes = NULL;
+    defrag.capacity = 0;
+    defrag.node_capacity = 0;
+    defrag.active = 0;
+}
+
+// start a sweep over every file from the start of the data area
+static void defrag_sweep(int sweep) {
+    memset(defrag.done, 0, MAX_FILES_ALLOWED);
+    defrag.sweep = sweep;
+    defrag.cursor = fs->data_idx;
+    defrag.high = fs->nblocks - 1;
+}
+
+// make room for capacity blocks in the list of the file's blocks
+static int defrag_grow(int capacity) {
+    struct defrag_block *blocks = realloc(defrag.blocks, capacity * sizeof(struct defrag_block));
+    if (!blocks) {
+        return -1;
+    }
+    defrag.blocks = blocks;
+    struct defrag_block *sorted = realloc(defrag.sorted, capacity * sizeof(struct defrag_block));
+    if (!sorted) {
+        return -1;
+    }
+    defrag.sorted = sorted;
+    defrag.capacity = capacity;
+    return 0;
+}
+
+// add a block to the list of the file's blocks, at position index
+static int defrag_add_block(int block, int index) {
+    if (defrag.length == defrag.capacity && defrag_grow(defrag.capacity ? defrag.capacity * 2 : 1024) == -1) {
+        return -1;
+    }
+    defrag.blocks[defrag.length].block = block;
+    defrag.blocks[defrag.length].index = index;
+    defrag.length++;
+    return 0;
+}
+
+// add an index block to the list of the file's index blocks, and to the blocks looked up by
+// block number as the index chain is followed
+static int defrag_add_node(int block, int parent, int slot, int level) {
+    if (defrag_add_block(block, defrag.node_count) == -1) {
+        return -1;
+    }
+    if (defrag.node_count == defrag.node_capacity) {
+        int capacity = defrag.node_capacity ? defrag.node_capacity * 2 : 64;
+        struct defrag_node *nodes = realloc(defrag.nodes, capacity * sizeof(struct defrag_node));
+        if (!nodes) {
+            return -1;
+        }
+        defrag.nodes = nodes;
+        defrag.node_capacity = capacity;
+    }
+    struct defrag_node *node = &defrag.nodes[defrag.node_count++];
+    node->block = block;
+    node->parent = parent;
+    node->slot = slot;
+    node->level = level;
+    return 0;
+}
+
+// choose the next file of the sweep, visiting files in the order they start on disk so free
+// space collects at the end; returns 0 once every file has been visited and -1 on error
+static int defrag_pick() {
+    int entry = -1;
+    int i;
+    for (i = 0; i < MAX_FILES_ALLOWED; i++) {
+        if (DIR[i].used && !defrag.done[i] && (entry < 0 || DIR[i].head < DIR[entry].head)) {
+            entry = i;
+        }
+    }
+    if (entry < 0) {
+        return 0;
+    }
+
+    defrag.done[entry] = 1;
+    defrag.entry = entry;
+    defrag.length = 0;
+    if (defrag.sweep == DEFRAG_RAISE) {
+        // start from the root of the block index
+        defrag.depth = DIR[entry].depth;
+        defrag.node_count = 0;
+        defrag.walk = 0;
+        defrag.step = DEFRAG_INDEX_WALK;
+        return defrag.depth == 0 || defrag_add_node(DIR[entry].index, -1, 0, defrag.depth) == 0 ? 1 : -1;
+    }
+    defrag.extents = 1;
+    defrag.walk = DIR[entry].head;
+    defrag.step = DEFRAG_WALK;
+
+    // room for every block up front, as growing the list would copy all of it in one slice;
+    // the memory is only touched as the chain is walked
+    int blocks = (DIR[entry].size + BLOCK_SIZE - 1) / BLOCK_SIZE + 1;
+    return blocks <= defrag.capacity || defrag_grow(blocks) == 0 ? 1 : -1;
+}
+
+// list the file's blocks, spending one unit of budget per block
+// returns 0 while blocks remain, 1 once the chain has been walked and -1 on error
+static int defrag_walk(int *budget) {
+    while (*budget > 0) {
+        if (defrag.walk < 0) {
+            return 1;
+        }
+        if (defrag_add_block(defrag.walk, defrag.length) == -1) {
+            return -1;
+        }
+
+        int next = fat_get(defrag.walk);
+        if (next == FAT_ERROR) {
+            return -1;
+        }
+        if (next >= 0 && next != defrag.walk + 1) {
+            defrag.extents++;
+        }
+        defrag.walk = next >= 0 ? next : -1;
+        (*budget)--;
+    }
+    return 0;
+}
+
+// start sorting the listed blocks, merging runs of one block into runs of two first
+static void defrag_sort_start() {
+    defrag.width = 1;
+    defrag.start = 0;
+    defrag.left = 0;
+    defrag.right = defrag.length < 1 ? defrag.length : 1;
+    defrag.step = DEFRAG_SORT;
+}
+
+// sort the listed blocks by block number with a merge sort that can stop after any block,
+// merging pairs of sorted runs from blocks into sorted and swapping the two once a pass is
+// done; spends one unit of budget per block merged
+// returns 0 while sorting and 1 once the blocks are sorted
+static int defrag_sort(int *budget) {
+    while (*budget > 0) {
+        if (defrag.width >= defrag.length) {
+            return 1;
+        }
+        int middle = defrag.start + defrag.width < defrag.length ? defrag.start + defrag.width : defrag.length;
+        int end = middle + defrag.width < defrag.length ? middle + defrag.width : defrag.length;
+
+        // pair merged: go on to the next pair, or to the next pass with runs twice as long
+        if (defrag.left == middle && defrag.right == end) {
+            defrag.start = end;
+            if (defrag.start == defrag.length) {
+                struct defrag_block *blocks = defrag.blocks;
+                defrag.blocks = defrag.sorted;
+                defrag.sorted = blocks;
+                defrag.width *= 2;
+                defrag.start = 0;
+            }
+            defrag.left = defrag.start;
+            defrag.right = defrag.start + defrag.width < defrag.length ? defrag.start + defrag.width : defrag.length;
+            continue;
+        }
+
+        int out = defrag.left + defrag.right - middle;
+        if (defrag.right == end ||
+            (defrag.left < middle && defrag.blocks[defrag.left].block < defrag.blocks[defrag.right].block)) {
+            defrag.sorted[out] = defrag.blocks[defrag.left++];
+        } else {
+            defrag.sorted[out] = defrag.blocks[defrag.right++];
+        }
+        (*budget)--;
+    }
+    return 0;
+}
+
+// find the lowest run from the cursor where every block is free, or already holds a block of the
+// file that will have been moved out of the way before the run reaches it, reserving free blocks
+// as they are checked so the allocator leaves them alone; spends one unit of budget per block
+// returns 0 while still looking, 1 once the run is reserved, 2 if there is none and -1 on error
+static int defrag_search(int *budget) {
+    while (*budget > 0) {
+        if (defrag.target > defrag.limit) {
+            return 2;
+        }
+        if (defrag.probe == defrag.target + defrag.length) {
+            return 1;
+        }
+
+        int value = fat_get(defrag.probe);
+        (*budget)--;
+        if (value == FAT_ERROR) {
+            return -1;
+        }
+        if (value == FREE) {
+            if (fat_set(defrag.probe, RESERVED) == -1) {
+                return -1;
+            }
+        } else {
+            int index = defrag_owned(defrag.probe);
+            if (index < 0 || index > defrag.probe - defrag.target) {
+                // blocked: give back what this try reserved and carry on past the block
+                *budget -= defrag.probe - defrag.target;
+                defrag_unreserve(defrag.probe);
+                if (defrag.target == defrag.cursor && defrag.probe == defrag.target) {
+                    defrag.cursor++;
+                }
+                defrag.target = defrag.probe + 1;
+            }
+        }
+        defrag.probe++;
+    }
+    return 0;
+}
+
+// move the file's blocks into its run one at a time, splicing each copy into the chain in place
+// of the original so the file stays usable between slices; a block moved costs DEFRAG_MOVE_COST
+// returns 0 while blocks remain, 1 once the file is done and -1 on error
+static int defrag_move(int *budget) {
+    char buffer[BLOCK_SIZE];
+    while (*budget > 0) {
+        int block = defrag.prev < 0 ? DIR[defrag.entry].head : fat_get(defrag.prev);
+        if (block == FAT_ERROR) {
+            return -1;
+        }
+
+        // file now lies in its destination run
+        if (block < 0 || defrag.moved == defrag.length) {
+            return 1;
+        }
+
+        int dest = defrag.target + defrag.moved;
+        if (block != dest) {
+            // destination taken by something other than this run
+            int value = fat_get(dest);
+            if (value == FAT_ERROR) {
+                return -1;
+            }
+            if (value != RESERVED) {
+                return 1;
+            }
+
+            // copy block and splice the copy into the chain in place of the original
+            if (block_read(block, buffer) == -1 || block_write(dest, buffer) == -1) {
+                return -1;
+            }
+            struct open_file *file = open_file_get(defrag.entry);
+            if (!file || index_set(file, defrag.moved, dest) == -1) {
+                return -1;
+            }
+            int next = fat_get(block);
+            if (next == FAT_ERROR || fat_set(dest, next) == -1) {
+                return -1;
+            }
+            map_forget(defrag.entry);
+            if (defrag.prev < 0) {
+                DIR[defrag.entry].head = dest;
+            } else if (fat_set(defrag.prev, dest) == -1) {
+                return -1;
+            }
+            if (block >= defrag.target && block < defrag.target + defrag.length) {
+                fat_set(block, RESERVED);
+            } else {
+                fat_set(block, FREE);
+            }
+            *budget -= DEFRAG_MOVE_COST;
+        } else {
+            (*budget)--;
+        }
+
+        defrag.prev = dest;
+        defrag.moved++;
+    }
+    return 0;
+}
+
+// list the file's index blocks, parents before children, reading each block above the bottom
+// level for the cost of a move; returns 0 while blocks remain, 1 once done and -1 on error
+static int defrag_index_walk(int *budget) {
+    int32_t node[INDEX_FANOUT];
+    while (*budget > 0) {
+        // the bottom level comes last and holds no index blocks
+        if (defrag.walk == defrag.node_count || defrag.nodes[defrag.walk].level == 1) {
+            return 1;
+        }
+        int level = defrag.nodes[defrag.walk].level;
+        if (block_read(defrag.nodes[defrag.walk].block, (char*) node) == -1) {
+            return -1;
+        }
+        int slot;
+        for (slot = 0; slot < INDEX_FANOUT; slot++) {
+            if (node[slot] >= 0 && defrag_add_node(node[slot], defrag.walk, slot, level - 1) == -1) {
+                return -1;
+            }
+        }
+        defrag.walk++;
+        *budget -= DEFRAG_MOVE_COST;
+    }
+    return 0;
+}
+
+// move the file's index blocks up into the highest free blocks, following its index chain so
+// each can be unlinked from the block before it; a block moved costs DEFRAG_MOVE_COST
+// returns 0 while blocks remain, 1 once the file is done and -1 on error
+static int defrag_index_move(int *budget) {
+    struct dir_entry *entry = &DIR[defrag.entry];
+    int32_t node[INDEX_FANOUT];
+    while (*budget > 0) {
+        // a deeper index has a new root the list does not know about
+        if (entry->depth != defrag.depth) {
+            return 1;
+        }
+        int block = defrag.prev < 0 ? entry->index_chain : fat_get(defrag.prev);
+        if (block == FAT_ERROR) {
+            return -1;
+        }
+        if (block < 0) {
+            return 1;
+        }
+
+        // nothing above high is free
+        int value;
+        while (defrag.high > block && (value = fat_get(defrag.high)) != FREE) {
+            if (value == FAT_ERROR) {
+                return -1;
+            }
+            defrag.high--;
+            if (--(*budget) <= 0) {
+                return 0;
+            }
+        }
+
+        // leave blocks above all free space, and any added since the index was listed
+        int n = defrag_owned(block);
+        if (defrag.high <= block || n < 0) {
+            defrag.prev = block;
+            (*budget)--;
+            continue;
+        }
+
+        // copy the block, with the cached bottom-level block written back first
+        int dest = defrag.high;
+        struct open_file *file = open_file_get(defrag.entry);
+        if (!file || leaf_flush(file) == -1) {
+            return -1;
+        }
+        if (block_read(block, (char*) node) == -1 || block_write(dest, (char*) node) == -1) {
+            return -1;
+        }
+
+        // point the index block above (or the directory entry, for the root) at the copy
+        struct defrag_node *moved = &defrag.nodes[n];
+        if (moved->parent < 0) {
+            entry->index = dest;
+        } else {
+            int parent = defrag.nodes[moved->parent].block;
+            if (block_read(parent, (char*) node) == -1) {
+                return -1;
+            }
+            node[moved->slot] = dest;
+            if (block_write(parent, (char*) node) == -1) {
+                return -1;
+            }
+        }
+
+        // splice the copy into the index chain in place of the original
+        int next = fat_get(block);
+        if (next == FAT_ERROR || fat_set(dest, next) == -1) {
+            return -1;
+        }
+        if (defrag.prev < 0) {
+            entry->index_chain = dest;
+        } else if (fat_set(defrag.prev, dest) == -1) {
+            return -1;
+        }
+        fat_set(block, FREE);
+        if (file->leaf == block) {
+            file->leaf = dest;
+        }
+        moved->block = dest;
+
+        defrag.prev = dest;
+        defrag.high--;
+        *budget -= DEFRAG_MOVE_COST;
+    }
+    return 0;
+}
+
+// move index blocks up to the end of the disk, relocate files into contiguous runs, then slide
+// every file down towards the start of the disk so free space ends up in one run between the
+// files and the index blocks; each call spends a budget of max_blocks block moves,
+// with FAT entries examined while planning counted at 1/DEFRAG_MOVE_COST of a move, and keeps its
+// place in the run for the next call so it can be interleaved with other work
+// returns 1 while work remains, 0 once the run is complete and -1 on error
+static int do_defrag(int max_blocks) {
+    if (!mounted || max_blocks <= 0) {
+        return -1;
+    }
+
+    // start a new run
+    if (!defrag.active) {
+        defrag_sweep(DEFRAG_RAISE);
+        defrag.entry = -1;
+        defrag.step = DEFRAG_PICK;
+        defrag.active = 1;
+    }
+
+    int budget = max_blocks < INT_MAX / DEFRAG_MOVE_COST ? max_blocks * DEFRAG_MOVE_COST : INT_MAX;
+    while (budget > 0) {
+        int status;
+        switch (defrag.step) {
+        case DEFRAG_PICK:
+            budget--;
+            status = defrag_pick();
+            if (status == -1) {
+                defrag_release();
+                return -1;
+            }
+            if (status == 1) {
+                break;
+            }
+            // every file visited: go on to the next sweep, or finish after the last
+            if (defrag.sweep != DEFRAG_SLIDE) {
+                defrag_sweep(defrag.sweep + 1);
+                break;
+            }
+            defrag_end();
+            return 0;
+
+        case DEFRAG_INDEX_WALK:
+            status = defrag_index_walk(&budget);
+            if (status == -1) {
+                defrag_release();
+                return -1;
+            }
+            if (status == 0) {
+                break;
+            }
+            // look index blocks up by block number as the chain is followed
+            defrag_sort_start();
+            break;
+
+        case DEFRAG_SORT:
+            if (!defrag_sort(&budget)) {
+                break;
+            }
+            if (defrag.sweep == DEFRAG_RAISE) {
+                defrag.prev = -1;
+                defrag.step = DEFRAG_INDEX_MOVE;
+                break;
+            }
+            defrag.target = defrag.cursor;
+            defrag.probe = defrag.cursor;
+            defrag.step = DEFRAG_SEARCH;
+            break;
+
+        case DEFRAG_INDEX_MOVE:
+            status = defrag_index_move(&budget);
+            if (status != 0) {
+                defrag_release();
+            }
+            if (status == -1) {
+                return -1;
+            }
+            break;
+
+        case DEFRAG_WALK:
+            status = defrag_walk(&budget);
+            if (status == -1) {
+                defrag_release();
+                return -1;
+            }
+            if (status == 0) {
+                break;
+            }
+            // joining leaves contiguous files alone; sliding only moves them into a gap
+            // below where they start
+            if (defrag.extents == 1 && defrag.sweep == DEFRAG_JOIN) {
+                defrag_release();
+                break;
+            }
+            defrag.limit = fs->nblocks - defrag.length;
+            if (defrag.extents == 1 && DIR[defrag.entry].head - 1 < defrag.limit) {
+                defrag.limit = DIR[defrag.entry].head - 1;
+            }
+            defrag_sort_start();
+            break;
+
+        case DEFRAG_SEARCH:
+            // blocks held for the last file dropped are still being given back, and the
+            // worker would free any of them reserved again; leave the rest of the slice
+            if (defrag.probe == defrag.target && (status = reclaim_run_pending()) != 0) {
+                if (status == -1) {
+                    defrag_release();
+                    return -1;
+                }
+                return 1;
+            }
+            status = defrag_search(&budget);
+            if (status == -1) {
+                defrag_release();
+                return -1;
+            }
+            if (status == 2) {
+                defrag_release();
+            } else if (status == 1) {
+                defrag.moved = 0;
+                defrag.prev = -1;
+                defrag.step = DEFRAG_MOVE;
+            }
+            break;
+
+        case DEFRAG_MOVE:
+            status = defrag_move(&budget);
+            if (status != 0) {
+                defrag_release();
+            }
+            if (status == -1) {
+                return -1;
+            }
+            break;
+        }
+    }
+
+    return 1;
+}
+
+// tracing: every public call goes through a wrapper that records it while a trace is open
+
+static int traced() {
+    return atomic_load_explicit(&tracing, memory_order_relaxed);
+}
+
+// offset of a descriptor, -1 if it is not open
+static off_t trace_offset(int fildes) {
+    struct file_descriptor *fd = fildes_get(fildes);
+    return fd ? fd->offset : -1;
+}
+
+// record the mounted volume and the files on it, so a replay can start from the same state
+static void trace_volume() {
+    trace_emit(TRACE_MOUNT, -1, NULL, 0, fs->nblocks, 0, trace_clock());
+    int i;
+    for (i = 0; i < MAX_FILES_ALLOWED; i++) {
+        if (DIR[i].used) {
+            trace_emit(TRACE_FILE, -1, DIR[i].name, 0, DIR[i].size, 0, trace_clock());
+        }
+    }
+}
+
+static void trace_exit() {
+    fs_trace_stop();
+}
+
+// record every call to the file system in a trace file at path until fs_trace_stop
+int fs_trace_start(char *path) {
+    if (trace_open(path) == -1) {
+        return -1;
+    }
+    if (mounted) {
+        trace_volume();
+    }
+    atomic_store(&tracing, 1);
+    return 0;
+}
+
+// stop recording and close the trace
+int fs_trace_stop() {
+    if (!atomic_exchange(&tracing, 0)) {
+        return -1;
+    }
+    return trace_close();
+}
+
+int fs_fat_budget(int pages) {
+    if (!traced()) {
+        return do_fat_budget(pages);
+    }
+    uint64_t start = trace_clock();
+    int result = do_fat_budget(pages);
+    trace_emit(TRACE_FAT_BUDGET, -1, NULL, 0, pages, result, start);
+    return result;
+}
+
+// a process can be traced without changing it by naming a trace in VFS_TRACE; tracing
+// starts at the first make_fs or mount
+static void trace_env() {
+    char *path = getenv("VFS_TRACE");
+    if (path && !trace_from_env) {
+        trace_from_env = 1;
+        if (!traced() && fs_trace_start(path) == 0) {
+            atexit(trace_exit);
+        }
+    }
+}
+
+int make_fs_sized(char* disk_name, int nblocks) {
+    trace_env();
+    if (!traced()) {
+        return do_make_fs(disk_name, nblocks);
+    }
+    uint64_t start = trace_clock();
+    int result = do_make_fs(disk_name, nblocks);
+    trace_emit(TRACE_MAKE_FS, -1, disk_name, 0, nblocks, result, start);
+    return result;
+}
+
+int mount_fs(char *disk_name) {
+    trace_env();
+    uint64_t start = trace_clock();
+    int result = do_mount(disk_name);
+    if (traced()) {
+        // a mounted volume is recorded with its files; a failed mount only as a call
+        if (result == 0) {
+            trace_volume();
+        } else {
+            trace_emit(TRACE_MOUNT, -1, NULL, 0, 0, result, start);
+        }
+    }
+    return result;
+}
+
+int umount_fs(char *disk_name) {
+    if (!traced()) {
+        return do_umount(disk_name);
+    }
+    uint64_t start = trace_clock();
+    int result = do_umount(disk_name);
+    trace_emit(TRACE_UMOUNT, -1, NULL, 0, 0, result, start);
+    trace_flush();
+    return result;
+}
+
+int fs_open(char *name) {
+    if (!traced()) {
+        return do_open(name);
+    }
+    uint64_t start = trace_clock();
+    int result = do_open(name);
+    trace_emit(TRACE_OPEN, -1, name, 0, 0, result, start);
+    return result;
+}
+
+int fs_close(int fildes) {
+    if (!traced()) {
+        return do_close(fildes);
+    }
+    uint64_t start = trace_clock();
+    int result = do_close(fildes);
+    trace_emit(TRACE_CLOSE, fildes, NULL, 0, 0, result, start);
+    return result;
+}
+
+int fs_create(char *name) {
+    if (!traced()) {
+        return do_create(name);
+    }
+    uint64_t start = trace_clock();
+    int result = do_create(name);
+    trace_emit(TRACE_CREATE, -1, name, 0, 0, result, start);
+    return result;
+}
+
+int fs_delete(char *name) {
+    if (!traced()) {
+        return do_delete(name);
+    }
+    uint64_t start = trace_clock();
+    int result = do_delete(name);
+    trace_emit(TRACE_DELETE, -1, name, 0, 0, result, start);
+    return result;
+}
+
+ssize_t fs_read(int fildes, void *buf, size_t nbyte) {
+    if (!traced()) {
+        return do_read(fildes, buf, nbyte);
+    }
+    uint64_t start = trace_clock();
+    off_t offset = trace_offset(fildes);
+    ssize_t result = do_read(fildes, buf, nbyte);
+    trace_emit(TRACE_READ, fildes, NULL, offset, nbyte, result, start);
+    return result;
+}
+
+ssize_t fs_write(int fildes, void *buf, size_t nbyte) {
+    if (!traced()) {
+        return do_write(fildes, buf, nbyte);
+    }
+    uint64_t start = trace_clock();
+    off_t offset = trace_offset(fildes);
+    ssize_t result = do_write(fildes, buf, nbyte);
+    trace_emit(TRACE_WRITE, fildes, NULL, offset, nbyte, result, start);
+    return result;
+}
+
+off_t fs_get_filesize(int fildes) {
+    if (!traced()) {
+        return do_get_filesize(fildes);
+    }
+    uint64_t start = trace_clock();
+    off_t result = do_get_filesize(fildes);
+    trace_emit(TRACE_GET_FILESIZE, fildes, NULL, 0, 0, result, start);
+    return result;
+}
+
+int fs_listfiles(char ***files) {
+    if (!traced()) {
+        return do_listfiles(files);
+    }
+    uint64_t start = trace_clock();
+    int result = do_listfiles(files);
+    trace_emit(TRACE_LISTFILES, -1, NULL, 0, 0, result, start);
+    return result;
+}
+
+int fs_lseek(int fildes, off_t offset) {
+    if (!traced()) {
+        return do_lseek(fildes, offset);
+    }
+    uint64_t start = trace_clock();
+    int result = do_lseek(fildes, offset);
+    trace_emit(TRACE_LSEEK, fildes, NULL, offset, 0, result, start);
+    return result;
+}
+
+int fs_truncate(int fildes, off_t length) {
+    if (!traced()) {
+        return do_truncate(fildes, length);
+    }
+    uint64_t start = trace_clock();
+    int result = do_truncate(fildes, length);
+    trace_emit(TRACE_TRUNCATE, fildes, NULL, 0, length, result, start);
+    return result;
+}
+
+int fs_frag_stats(struct fs_frag_stats *stats) {
+    if (!traced()) {
+        return do_frag_stats(stats);
+    }
+    uint64_t start = trace_clock();
+    int result = do_frag_stats(stats);
+    trace_emit(TRACE_FRAG_STATS, -1, NULL, 0, 0, result, start);
+    return result;
+}
+
+int fs_file_extents(char *name) {
+    if (!traced()) {
+        return do_file_extents(name);
+    }
+    uint64_t start = trace_clock();
+    int result = do_file_extents(name);
+    trace_emit(TRACE_FILE_EXTENTS, -1, name, 0, 0, result, start);
+    return result;
+}
+
+int fs_defrag(int max_blocks) {
+    if (!traced()) {
+        return do_defrag(max_blocks);
+    }
+    uint64_t start = trace_clock();
+    int result = do_defrag(max_blocks);
+    trace_emit(TRACE_DEFRAG, -1, NULL, 0, max_blocks, result, start);
+    return result;
 }
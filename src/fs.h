@@ -8,8 +8,27 @@
 #include <fcntl.h>
 #include <string.h>
 
+#define MAX_FILES_ALLOWED 64    // max 64 files at any given time
+#define MAX_F_NAME 15   // max 15 character filenames
+
+// fragmentation report produced by fs_frag_stats
+struct fs_frag_stats {
+    int files;          // files in the directory
+    int fragmented;     // files stored in more than one extent
+    int blocks;         // data blocks held by files
+    int extents;        // contiguous runs of blocks held by files
+    int index_blocks;   // blocks holding the files' block indexes
+    int free_blocks;    // unallocated data blocks
+    int free_extents;   // contiguous runs of unallocated blocks
+    int largest_free;   // longest run of unallocated blocks
+};
+
 int make_fs(char* diskname);
 
+int make_fs_sized(char* diskname, int nblocks);
+
+int fs_fat_budget(int pages);
+
 int mount_fs(char *disk_name);
 
 int umount_fs(char *disk_name);
@@ -22,11 +41,11 @@ int fs_create(char *name);
 
 int fs_delete(char *name);
 
-int fs_read(int fildes, void *buf, size_t nbyte);
+ssize_t fs_read(int fildes, void *buf, size_t nbyte);
 
-int fs_write(int fildes, void *buf, size_t nbyte);
+ssize_t fs_write(int fildes, void *buf, size_t nbyte);
 
-int fs_get_filesize(int fildes);
+off_t fs_get_filesize(int fildes);
 
 int fs_listfiles(char ***files);
 
@@ -34,4 +53,14 @@ int fs_lseek(int fildes, off_t offset);
 
 int fs_truncate(int fildes, off_t length);
 
+int fs_frag_stats(struct fs_frag_stats *stats);
+
+int fs_file_extents(char *name);
+
+int fs_defrag(int max_blocks);
+
+int fs_trace_start(char *path);
+
+int fs_trace_stop();
+
 #endif
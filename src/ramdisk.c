@@ -0,0 +1,200 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#include "disk.h"
+#include "ramdisk.h"
+
+static int ram_make(char *name, int blocks);
+static int ram_open(char *name);
+static int ram_close();
+static int ram_transfer(int write, int block, int count, char *buf);
+static int ram_snapshot(char *name);
+
+struct disk_backend ram_backend = {
+  "ram:", ram_make, ram_open, ram_close, ram_transfer, ram_snapshot
+};
+
+/******************************************************************************/
+struct ram_disk {
+  char *name;                     /* name without the "ram:" prefix           */
+  char *mem;                      /* contents of the disk                     */
+  int blocks;                     /* blocks on the disk                       */
+};
+
+static struct ram_disk disks[MAX_RAM_DISKS];
+static struct ram_disk *current;  /* disk that is open, if any                */
+
+/******************************************************************************/
+static struct ram_disk *ram_find(char *name)
+{
+  int i;
+
+  for (i = 0; i < MAX_RAM_DISKS; ++i)
+    if (disks[i].name && strcmp(disks[i].name, name) == 0)
+      return &disks[i];
+
+  return NULL;
+}
+
+/* take a free slot and give it a zeroed disk */
+static struct ram_disk *ram_alloc(char *name, int blocks)
+{
+  int i;
+
+  for (i = 0; i < MAX_RAM_DISKS; ++i)
+    if (!disks[i].name)
+      break;
+
+  if (i == MAX_RAM_DISKS) {
+    fprintf(stderr, "ram disk: too many disks in memory\n");
+    return NULL;
+  }
+
+  /* calloc leaves untouched blocks to be zeroed by the system on first use */
+  disks[i].mem = calloc(blocks, BLOCK_SIZE);
+  disks[i].name = malloc(strlen(name) + 1);
+  if (!disks[i].mem || !disks[i].name) {
+    fprintf(stderr, "ram disk: out of memory\n");
+    free(disks[i].mem);
+    free(disks[i].name);
+    disks[i].mem = disks[i].name = NULL;
+    return NULL;
+  }
+  strcpy(disks[i].name, name);
+  disks[i].blocks = blocks;
+
+  return &disks[i];
+}
+
+/******************************************************************************/
+static int ram_make(char *name, int blocks)
+{
+  struct ram_disk *d;
+
+  if ((d = ram_find(name))) {
+    if (d == current) {
+      fprintf(stderr, "make_disk: disk is open\n");
+      return -1;
+    }
+    ram_disk_free(name);
+  }
+
+  return ram_alloc(name, blocks) ? 0 : -1;
+}
+
+static int ram_open(char *name)
+{
+  struct ram_disk *d;
+  struct stat st;
+  ssize_t done, n, len;
+  int f;
+
+  if ((d = ram_find(name))) {
+    current = d;
+    return d->blocks;
+  }
+
+  /* not in memory: load the image file of the same name */
+  if ((f = open(name, O_RDONLY)) < 0) {
+    perror("open_disk: cannot open file");
+    return -1;
+  }
+
+  if (fstat(f, &st) < 0 || st.st_size < BLOCK_SIZE || st.st_size / BLOCK_SIZE > INT_MAX) {
+    fprintf(stderr, "open_disk: invalid disk size\n");
+    close(f);
+    return -1;
+  }
+
+  if (!(d = ram_alloc(name, st.st_size / BLOCK_SIZE))) {
+    close(f);
+    return -1;
+  }
+
+  len = (ssize_t) d->blocks * BLOCK_SIZE;
+  for (done = 0; done < len; done += n) {
+    if ((n = read(f, d->mem + done, len - done)) <= 0) {
+      fprintf(stderr, "open_disk: failed to read image\n");
+      close(f);
+      ram_disk_free(name);
+      return -1;
+    }
+  }
+
+  close(f);
+  current = d;
+
+  return d->blocks;
+}
+
+static int ram_close()
+{
+  current = NULL;
+
+  return 0;
+}
+
+static int ram_transfer(int write, int block, int count, char *buf)
+{
+  char *p = current->mem + (size_t) block * BLOCK_SIZE;
+
+  if (write)
+    memcpy(p, buf, (size_t) count * BLOCK_SIZE);
+  else
+    memcpy(buf, p, (size_t) count * BLOCK_SIZE);
+
+  return 0;
+}
+
+static int ram_snapshot(char *name)
+{
+  ssize_t done, n, len = (ssize_t) current->blocks * BLOCK_SIZE;
+  int f;
+
+  if ((f = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+    perror("disk_snapshot: cannot open file");
+    return -1;
+  }
+
+  for (done = 0; done < len; done += n) {
+    if ((n = write(f, current->mem + done, len - done)) < 0) {
+      perror("disk_snapshot: failed to write");
+      close(f);
+      return -1;
+    }
+  }
+
+  close(f);
+
+  return 0;
+}
+
+int ram_disk_free(char *name)
+{
+  struct ram_disk *d;
+
+  /* the disk's full name, or the name without the prefix */
+  if (name && strncmp(name, ram_backend.prefix, strlen(ram_backend.prefix)) == 0)
+    name += strlen(ram_backend.prefix);
+
+  if (!name || !(d = ram_find(name))) {
+    fprintf(stderr, "ram_disk_free: no such disk\n");
+    return -1;
+  }
+
+  if (d == current) {
+    fprintf(stderr, "ram_disk_free: disk is open\n");
+    return -1;
+  }
+
+  free(d->mem);
+  free(d->name);
+  d->mem = d->name = NULL;
+
+  return 0;
+}
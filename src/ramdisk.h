@@ -0,0 +1,20 @@
+#ifndef _RAMDISK_H_
+#define _RAMDISK_H_
+
+#include "disk.h"
+
+/* Disks named "ram:<name>" are held in memory for the life of the process,   */
+/* so block reads and writes are plain memory copies with no system calls.    */
+/* make_disk creates a zeroed disk; open_disk attaches to it or, when no disk */
+/* of that name is in memory yet, loads the image file <name> (for example    */
+/* one saved with disk_snapshot). Blocks are copied without any locking, so   */
+/* requests for different blocks never wait on each other.                    */
+
+#define MAX_RAM_DISKS 8        /* most disks held in memory at once           */
+
+extern struct disk_backend ram_backend;
+
+int ram_disk_free(char *name); /* release a disk that is not open, by its full */
+                               /* name ("ram:<name>") or by <name> alone      */
+
+#endif
@@ -0,0 +1,556 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "fs.h"
+#include "disk.h"
+#include "trace.h"
+
+#define THREADS 1   // default number of replay threads
+#define FILL_SIZE (1024 * 1024) // bytes written at a time when recreating files found at mount
+
+// a traced call prepared for replay
+struct call {
+    struct trace_record rec;
+    char *name;             // file name given to the call, NULL if none
+    unsigned key;           // hash of the file the call works on, picks the thread replaying it
+    int handle;             // open descriptor the call uses (see below), -1 if none
+    int global;             // works on the whole volume, so replayed by one thread between barriers
+    int skip;               // uses a descriptor opened before the trace started
+    int64_t result;         // what the replayed call returned
+    uint64_t latency;       // nanoseconds the replayed call took
+};
+
+// descriptors in a trace are reused once closed, so every fs_open in the trace gets a handle of
+// its own and calls refer to the handle; all calls on a handle are on the same file and therefore
+// replayed by the same thread
+struct replay {
+    struct call *calls;
+    int ncalls;
+    int *fd;                // descriptor of each handle during the replay
+    int nhandles;
+    char *disk_name;
+    int threads;
+    int recorded;           // keep the recorded time between calls
+    uint64_t origin;        // trace time of the first call
+    uint64_t start;         // clock reading when the replay started
+    size_t buffer_size;     // largest read or write in the trace
+    int mounted;
+    uint64_t setup;         // nanoseconds spent recreating files found at mount
+    int mismatches;         // calls that returned something other than what was recorded
+    int skipped;
+    pthread_mutex_t lock;   // held for mismatches
+    pthread_rwlock_t names; // held shared for calls on one file, exclusive for calls that change the directory
+    pthread_barrier_t barrier;
+};
+
+struct worker {
+    struct replay *replay;
+    int id;
+    pthread_t thread;
+    char *buffer;
+};
+
+static unsigned hash(char *name) {
+    unsigned h = 5381;
+    while (*name) {
+        h = h * 33 + (unsigned char) *name++;
+    }
+    return h;
+}
+
+static int is_global(int op) {
+    return op == TRACE_MOUNT || op == TRACE_UMOUNT || op == TRACE_FILE || op == TRACE_LISTFILES ||
+           op == TRACE_FRAG_STATS || op == TRACE_DEFRAG || op == TRACE_FAT_BUDGET || op == TRACE_MAKE_FS;
+}
+
+static const char *op_name(int op) {
+    static const char *names[TRACE_OPS] = {
+        "?", "mount", "umount", "file", "open", "close", "create", "delete", "read", "write",
+        "filesize", "listfiles", "lseek", "truncate", "frag_stats", "file_extents", "defrag",
+        "fat_budget", "make_fs"
+    };
+    return op > 0 && op < TRACE_OPS ? names[op] : names[0];
+}
+
+// read a whole trace into memory
+static char *load(char *path, size_t *len) {
+    int f = open(path, O_RDONLY);
+    struct stat st;
+    if (f < 0 || fstat(f, &st) < 0) {
+        perror(path);
+        if (f >= 0) {
+            close(f);
+        }
+        return NULL;
+    }
+    char *data = malloc(st.st_size ? st.st_size : 1);
+    size_t done = 0;
+    while (data && done < (size_t) st.st_size) {
+        ssize_t n = read(f, data + done, st.st_size - done);
+        if (n <= 0) {
+            perror(path);
+            free(data);
+            data = NULL;
+            break;
+        }
+        done += n;
+    }
+    close(f);
+    *len = done;
+    return data;
+}
+
+// split a trace into calls and give each the file and handle it works on
+static int prepare(struct replay *replay, char *data, size_t len) {
+    struct trace_header header;
+    if (len < sizeof(header)) {
+        return -1;
+    }
+    memcpy(&header, data, sizeof(header));
+    if (memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version < 1 || header.version > TRACE_VERSION || header.block_size != BLOCK_SIZE) {
+        return -1;
+    }
+
+    // count calls and find the largest descriptor
+    size_t pos;
+    int n = 0;
+    int max_fd = 0;
+    struct trace_record rec;
+    for (pos = sizeof(header); pos + sizeof(rec) <= len; pos += sizeof(rec) + rec.name_len) {
+        memcpy(&rec, data + pos, sizeof(rec));
+        if (rec.fd > max_fd) {
+            max_fd = rec.fd;
+        }
+        if (rec.op == TRACE_OPEN && rec.result > max_fd) {
+            max_fd = rec.result;
+        }
+        n++;
+    }
+
+    replay->calls = calloc(n ? n : 1, sizeof(struct call));
+    replay->fd = malloc((n ? n : 1) * sizeof(int));
+    int *handle_of = malloc((max_fd + 1) * sizeof(int));   // current handle of each traced descriptor
+    unsigned *key_of = malloc((n ? n : 1) * sizeof(unsigned)); // file of each handle
+    if (!replay->calls || !replay->fd || !handle_of || !key_of) {
+        return -1;
+    }
+    int i;
+    for (i = 0; i <= max_fd; i++) {
+        handle_of[i] = -1;
+    }
+
+    replay->ncalls = 0;
+    replay->nhandles = 0;
+    for (pos = sizeof(header); pos + sizeof(rec) <= len; pos += sizeof(rec) + rec.name_len) {
+        struct call *call = &replay->calls[replay->ncalls++];
+        memcpy(&rec, data + pos, sizeof(rec));
+        if (pos + sizeof(rec) + rec.name_len > len) {
+            replay->ncalls--;
+            break;
+        }
+        call->rec = rec;
+        call->handle = -1;
+        call->global = is_global(rec.op);
+        if (rec.name_len > 0) {
+            call->name = strndup(data + pos + sizeof(rec), rec.name_len);
+            call->key = hash(call->name);
+        }
+
+        if (rec.op == TRACE_OPEN && rec.result >= 0) {
+            call->handle = replay->nhandles++;
+            key_of[call->handle] = call->key;
+            handle_of[rec.result] = call->handle;
+        } else if (rec.fd >= 0 && !call->global) {
+            call->handle = handle_of[rec.fd];
+            if (call->handle >= 0) {
+                call->key = key_of[call->handle];
+                if (rec.op == TRACE_CLOSE && rec.result == 0) {
+                    handle_of[rec.fd] = -1;
+                }
+            } else if (rec.result >= 0) {
+                // the file was opened before the trace started, so it is unknown
+                call->skip = 1;
+                replay->skipped++;
+                continue;
+            }
+            // otherwise the descriptor was not open and the call is replayed with an invalid one
+        } else if (rec.op == TRACE_UMOUNT) {
+            // descriptors do not survive an unmount
+            for (i = 0; i <= max_fd; i++) {
+                handle_of[i] = -1;
+            }
+        }
+
+        if ((rec.op == TRACE_READ || rec.op == TRACE_WRITE) && (size_t) rec.size > replay->buffer_size) {
+            replay->buffer_size = rec.size;
+        }
+    }
+    for (i = 0; i < replay->nhandles; i++) {
+        replay->fd[i] = -1;
+    }
+    if (replay->ncalls > 0) {
+        replay->origin = replay->calls[0].rec.time;
+    }
+
+    free(handle_of);
+    free(key_of);
+    return 0;
+}
+
+// create a file that was on the traced volume and grow it to the recorded size
+static void recreate(struct call *call, char *buffer, size_t size) {
+    int fd = fs_open(call->name);
+    if (fd == -1 && (fs_create(call->name) == -1 || (fd = fs_open(call->name)) == -1)) {
+        return;
+    }
+    memset(buffer, 0, size);
+    off_t length = fs_get_filesize(fd);
+    fs_lseek(fd, length);
+    while (length < call->rec.size) {
+        size_t n = size;
+        if (call->rec.size - length < (off_t) size) {
+            n = call->rec.size - length;
+        }
+        ssize_t written = fs_write(fd, buffer, n);
+        if (written <= 0) {
+            break;
+        }
+        length += written;
+    }
+    fs_close(fd);
+}
+
+// issue one call, returning what the file system returned
+static int64_t issue(struct replay *replay, struct call *call, char *buffer) {
+    struct trace_record *rec = &call->rec;
+    int fd = call->handle >= 0 ? replay->fd[call->handle] : -1;
+    struct fs_frag_stats stats;
+    char **files;
+    int64_t result = 0;
+
+    switch (rec->op) {
+    case TRACE_MAKE_FS:
+        result = make_fs_sized(replay->disk_name, rec->size);
+        break;
+    case TRACE_MOUNT:
+        // a mount that failed in the trace would succeed on the replay's volume
+        if (rec->result < 0) {
+            result = rec->result;
+        } else if (!replay->mounted) {
+            result = mount_fs(replay->disk_name);
+            replay->mounted = result == 0;
+        }
+        break;
+    case TRACE_UMOUNT:
+        result = umount_fs(replay->disk_name);
+        replay->mounted = 0;
+        break;
+    case TRACE_OPEN:
+        result = fs_open(call->name);
+        if (call->handle >= 0) {
+            replay->fd[call->handle] = result;
+        }
+        // descriptor numbers differ between runs; only success matters
+        return rec->result >= 0 ? (result >= 0 ? rec->result : -1) : result;
+    case TRACE_CLOSE:
+        result = fs_close(fd);
+        break;
+    case TRACE_CREATE:
+        result = fs_create(call->name);
+        break;
+    case TRACE_DELETE:
+        result = fs_delete(call->name);
+        break;
+    case TRACE_READ:
+        result = fs_read(fd, buffer, rec->size);
+        break;
+    case TRACE_WRITE:
+        result = fs_write(fd, buffer, rec->size);
+        break;
+    case TRACE_GET_FILESIZE:
+        result = fs_get_filesize(fd);
+        break;
+    case TRACE_LISTFILES:
+        result = fs_listfiles(&files);
+        if (result == 0) {
+            free(files);
+        }
+        break;
+    case TRACE_LSEEK:
+        result = fs_lseek(fd, rec->offset);
+        break;
+    case TRACE_TRUNCATE:
+        result = fs_truncate(fd, rec->size);
+        break;
+    case TRACE_FRAG_STATS:
+        result = fs_frag_stats(&stats);
+        break;
+    case TRACE_FILE_EXTENTS:
+        result = fs_file_extents(call->name);
+        break;
+    case TRACE_DEFRAG:
+        result = fs_defrag(rec->size);
+        break;
+    case TRACE_FAT_BUDGET:
+        result = fs_fat_budget(rec->size);
+        break;
+    }
+    return result;
+}
+
+// replay a call, waiting for its recorded time first if asked to
+static void run(struct worker *worker, struct call *call) {
+    struct replay *replay = worker->replay;
+    if (replay->recorded) {
+        uint64_t due = replay->start + (call->rec.time > replay->origin ? call->rec.time - replay->origin : 0);
+        struct timespec at = { due / 1000000000, due % 1000000000 };
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &at, NULL) != 0) {
+        }
+    }
+
+    int exclusive = call->rec.op == TRACE_OPEN || call->rec.op == TRACE_CREATE || call->rec.op == TRACE_DELETE;
+    if (!call->global) {
+        if (exclusive) {
+            pthread_rwlock_wrlock(&replay->names);
+        } else {
+            pthread_rwlock_rdlock(&replay->names);
+        }
+    }
+
+    uint64_t start = trace_clock();
+    int64_t result;
+    if (call->rec.op == TRACE_FILE) {
+        recreate(call, worker->buffer, replay->buffer_size);
+        replay->setup += trace_clock() - start;
+        result = call->rec.result;
+    } else {
+        result = issue(replay, call, worker->buffer);
+    }
+    call->latency = trace_clock() - start;
+    call->result = result;
+
+    if (!call->global) {
+        pthread_rwlock_unlock(&replay->names);
+    }
+    if (result != call->rec.result) {
+        pthread_mutex_lock(&replay->lock);
+        replay->mismatches++;
+        pthread_mutex_unlock(&replay->lock);
+    }
+}
+
+// replay the calls on this worker's share of the files; calls on the whole volume are made
+// by the first worker while the others wait at a barrier
+static void *worker_main(void *arg) {
+    struct worker *worker = arg;
+    struct replay *replay = worker->replay;
+    int i;
+    for (i = 0; i < replay->ncalls; i++) {
+        struct call *call = &replay->calls[i];
+        if (call->skip) {
+            continue;
+        }
+        if (call->global) {
+            pthread_barrier_wait(&replay->barrier);
+            if (worker->id == 0) {
+                run(worker, call);
+            }
+            pthread_barrier_wait(&replay->barrier);
+        } else if (call->key % replay->threads == (unsigned) worker->id) {
+            run(worker, call);
+        }
+    }
+    return NULL;
+}
+
+static int compare_latency(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+// print throughput and the latency distribution of each kind of call
+static void report(struct replay *replay, double secs) {
+    uint64_t *latencies = malloc((replay->ncalls ? replay->ncalls : 1) * sizeof(uint64_t));
+    long long calls = 0;
+    long long bytes_read = 0;
+    long long bytes_written = 0;
+    int i, op;
+    for (i = 0; i < replay->ncalls; i++) {
+        struct call *call = &replay->calls[i];
+        if (call->skip || call->rec.op == TRACE_FILE) {
+            continue;
+        }
+        calls++;
+        if (call->rec.op == TRACE_READ && call->result > 0) {
+            bytes_read += call->result;
+        } else if (call->rec.op == TRACE_WRITE && call->result > 0) {
+            bytes_written += call->result;
+        }
+    }
+
+    printf("replayed %lld calls in %.3f s with %d thread%s: %.0f calls/s, read %.1f MiB/s, write %.1f MiB/s\n",
+           calls, secs, replay->threads, replay->threads == 1 ? "" : "s", secs > 0 ? calls / secs : 0,
+           secs > 0 ? bytes_read / (1024.0 * 1024.0) / secs : 0,
+           secs > 0 ? bytes_written / (1024.0 * 1024.0) / secs : 0);
+    printf("%-14s %10s %10s %10s %10s %10s %10s\n", "call", "count", "mean us", "p50 us", "p90 us", "p99 us", "max us");
+    for (op = 1; op < TRACE_OPS; op++) {
+        int n = 0;
+        double total = 0;
+        for (i = 0; i < replay->ncalls; i++) {
+            struct call *call = &replay->calls[i];
+            if (!call->skip && call->rec.op == op && op != TRACE_FILE) {
+                latencies[n++] = call->latency;
+                total += call->latency;
+            }
+        }
+        if (n == 0) {
+            continue;
+        }
+        qsort(latencies, n, sizeof(uint64_t), compare_latency);
+        printf("%-14s %10d %10.1f %10.1f %10.1f %10.1f %10.1f\n", op_name(op), n, total / n / 1e3,
+               latencies[n * 50 / 100] / 1e3, latencies[n * 90 / 100] / 1e3,
+               latencies[n * 99 / 100] / 1e3, latencies[n - 1] / 1e3);
+    }
+    free(latencies);
+
+    if (replay->mismatches) {
+        printf("%d calls returned something other than what was recorded\n", replay->mismatches);
+    }
+    if (replay->skipped) {
+        printf("%d calls skipped: their descriptors were opened before the trace started\n", replay->skipped);
+    }
+}
+
+static void usage(char *prog) {
+    fprintf(stderr, "usage: %s [-b blocks] [-j threads] [-r] trace disk\n", prog);
+    fprintf(stderr, "  -b  blocks on the fresh file system (default: as traced, else %d)\n", DISK_BLOCKS);
+    fprintf(stderr, "  -j  threads replaying calls, each taking a share of the files (default %d)\n", THREADS);
+    fprintf(stderr, "  -r  keep the recorded time between calls (default: as fast as possible)\n");
+}
+
+int main(int argc, char **argv) {
+    int blocks = 0;
+    int threads = THREADS;
+    int recorded = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "b:j:r")) != -1) {
+        switch (opt) {
+        case 'b':
+            blocks = atoi(optarg);
+            break;
+        case 'j':
+            threads = atoi(optarg);
+            break;
+        case 'r':
+            recorded = 1;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind != argc - 2 || blocks < 0 || threads <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    char *trace_name = argv[optind];
+    char *disk_name = argv[optind + 1];
+
+    struct replay replay;
+    memset(&replay, 0, sizeof(replay));
+    size_t len;
+    char *data = load(trace_name, &len);
+    if (!data) {
+        return 1;
+    }
+    if (prepare(&replay, data, len) == -1) {
+        fprintf(stderr, "%s: %s is not a trace of this file system\n", argv[0], trace_name);
+        return 1;
+    }
+    free(data);
+    replay.disk_name = disk_name;
+    replay.threads = threads;
+    replay.recorded = recorded;
+    if (replay.buffer_size < FILL_SIZE) {
+        replay.buffer_size = FILL_SIZE;
+    }
+
+    int i;
+    // start from a fresh volume of the traced size, unless the trace makes its own
+    // (failed mounts before that change nothing)
+    for (i = 0; i < replay.ncalls && replay.calls[i].rec.op == TRACE_MOUNT && replay.calls[i].rec.result < 0; i++) {
+    }
+    int makes = i < replay.ncalls && replay.calls[i].rec.op == TRACE_MAKE_FS;
+    if (blocks == 0) {
+        blocks = DISK_BLOCKS;
+        for (i = 0; i < replay.ncalls; i++) {
+            if (replay.calls[i].rec.op == TRACE_MOUNT && replay.calls[i].rec.result == 0) {
+                blocks = replay.calls[i].rec.size;
+                break;
+            }
+        }
+    }
+    if (!makes) {
+        if (make_fs_sized(disk_name, blocks) == -1 || mount_fs(disk_name) == -1) {
+            fprintf(stderr, "%s: cannot make file system on %s\n", argv[0], disk_name);
+            return 1;
+        }
+        replay.mounted = 1;
+    }
+
+    struct worker *workers = calloc(threads, sizeof(struct worker));
+    for (i = 0; i < threads; i++) {
+        workers[i].replay = &replay;
+        workers[i].id = i;
+        if (!(workers[i].buffer = malloc(replay.buffer_size))) {
+            fprintf(stderr, "%s: out of memory\n", argv[0]);
+            return 1;
+        }
+        memset(workers[i].buffer, 'x', replay.buffer_size);
+    }
+    pthread_mutex_init(&replay.lock, NULL);
+    pthread_rwlock_init(&replay.names, NULL);
+    pthread_barrier_init(&replay.barrier, NULL, threads);
+
+    // calls on different files run in parallel; the file system keeps the directory
+    // consistent only for one caller at a time, so calls that change it run alone
+    replay.start = trace_clock();
+    for (i = 1; i < threads; i++) {
+        pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]);
+    }
+    worker_main(&workers[0]);
+    for (i = 1; i < threads; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    double secs = (trace_clock() - replay.start - replay.setup) / 1e9;
+
+    report(&replay, secs);
+
+    pthread_barrier_destroy(&replay.barrier);
+    pthread_rwlock_destroy(&replay.names);
+    pthread_mutex_destroy(&replay.lock);
+    for (i = 0; i < threads; i++) {
+        free(workers[i].buffer);
+    }
+    free(workers);
+    for (i = 0; i < replay.ncalls; i++) {
+        free(replay.calls[i].name);
+    }
+    free(replay.calls);
+    free(replay.fd);
+
+    if (replay.mounted && umount_fs(disk_name) == -1) {
+        fprintf(stderr, "%s: cannot unmount %s\n", argv[0], disk_name);
+        return 1;
+    }
+    return 0;
+}
@@ -1,14 +1,58 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
 #include "fs.h"
 #include "disk.h"
+#include "ramdisk.h"
 
 #define SIZE 1000
-int main()
+#define OPENERS 8           // threads opening descriptors at once
+#define OPENS 600           // descriptors each of them holds, several table chunks in all
+#define LARGE_BLOCKS 1300000    // blocks on the disk holding the large file (about 5 GiB)
+#define LARGE_SIZE ((off_t) 4608 << 20) // bytes in the large file (4.5 GiB)
+#define CHUNK (8 << 20)
+
+// contents expected at offset of a file, a word at a time, so any misplaced block shows
+static void fill(char *buf, int seed, off_t offset, size_t n)
+{
+    size_t i = 0;
+    while (i < n)
+    {
+        off_t at = offset + i;
+        uint64_t word = (uint64_t) (at & ~7) * 2654435761u + seed;
+        size_t len = 8 - at % 8 < n - i ? 8 - at % 8 : n - i;
+        memcpy(buf + i, (char *) &word + at % 8, len);
+        i += len;
+    }
+}
+
+static void write_at(int fd, int seed, off_t offset, size_t n)
+{
+    char *buf = malloc(n);
+    fill(buf, seed, offset, n);
+    assert(fs_lseek(fd, offset) == 0);
+    assert(fs_write(fd, buf, n) == (ssize_t) n);
+    free(buf);
+}
+
+static void check_at(int fd, int seed, off_t offset, size_t n)
+{
+    char *buf = malloc(n);
+    char *expected = malloc(n);
+    fill(expected, seed, offset, n);
+    assert(fs_lseek(fd, offset) == 0);
+    assert(fs_read(fd, buf, n) == (ssize_t) n);
+    assert(memcmp(buf, expected, n) == 0);
+    free(buf);
+    free(expected);
+}
+
+static void test_basic(char *disk_name)
 {
-    char *disk_name = "mydisk";
     char *file_name = "myfile";
 
     assert(make_fs(disk_name) == 0);
@@ -47,6 +91,426 @@ int main()
     assert(fs_delete(file_name) == 0);
 
     assert(umount_fs(disk_name) == 0);
+}
+
+static void *opener(void *arg)
+{
+    int *fds = arg;
+    for (int round = 0; round < 3; round++)
+    {
+        for (int i = 0; i < OPENS; i++)
+        {
+            fds[i] = fs_open("shared");
+            assert(fds[i] > -1);
+        }
+        if (round < 2)
+        {
+            for (int i = 0; i < OPENS; i++)
+            {
+                assert(fs_close(fds[i]) == 0);
+            }
+        }
+    }
+    return NULL;
+}
+
+static int compare_int(const void *a, const void *b)
+{
+    return *(const int *) a - *(const int *) b;
+}
+
+// threads open and close descriptors while the table grows under them
+static void test_concurrent_open(char *disk_name)
+{
+    static int fds[OPENERS * OPENS];
+    pthread_t threads[OPENERS];
+
+    assert(make_fs(disk_name) == 0);
+    assert(mount_fs(disk_name) == 0);
+    assert(fs_create("shared") == 0);
+
+    for (int t = 0; t < OPENERS; t++)
+    {
+        assert(pthread_create(&threads[t], NULL, opener, &fds[t * OPENS]) == 0);
+    }
+    for (int t = 0; t < OPENERS; t++)
+    {
+        pthread_join(threads[t], NULL);
+    }
+
+    // every descriptor still open was handed out once
+    qsort(fds, OPENERS * OPENS, sizeof(int), compare_int);
+    for (int i = 1; i < OPENERS * OPENS; i++)
+    {
+        assert(fds[i] != fds[i - 1]);
+    }
+    assert(fs_delete("shared") == -1);
+    for (int i = 0; i < OPENERS * OPENS; i++)
+    {
+        assert(fs_close(fds[i]) == 0);
+    }
+    assert(fs_close(fds[0]) == -1);
+    assert(fs_delete("shared") == 0);
+    assert(umount_fs(disk_name) == 0);
+}
+
+static void *reopener(void *arg)
+{
+    (void) arg;
+    int fd;
+    while ((fd = fs_open("victim")) > -1)
+    {
+        // a counted descriptor keeps the file from being deleted under it
+        assert(fs_write(fd, "x", 1) == 1);
+        assert(fs_close(fd) == 0);
+    }
+    return NULL;
+}
+
+static void *closer(void *arg)
+{
+    int *fds = arg;
+    int closed = 0;
+    for (int i = 0; i < OPENS; i++)
+    {
+        if (fs_close(fds[i]) == 0)
+        {
+            closed++;
+        }
+    }
+    return (void *) (intptr_t) closed;
+}
+
+// deletes race opens of the same file, and closes race each other on the same descriptors
+static void test_open_delete(char *disk_name)
+{
+    static int fds[OPENS];
+    pthread_t threads[2];
+
+    assert(make_fs(disk_name) == 0);
+    assert(mount_fs(disk_name) == 0);
+    assert(fs_create("victim") == 0);
+
+    assert(pthread_create(&threads[0], NULL, reopener, NULL) == 0);
+    while (fs_delete("victim") == -1)
+    {
+    }
+    pthread_join(threads[0], NULL);
+    assert(fs_open("victim") == -1);
+    assert(fs_create("victim") == 0);
+
+    // each descriptor is closed by exactly one of the two threads
+    for (int i = 0; i < OPENS; i++)
+    {
+        fds[i] = fs_open("victim");
+        assert(fds[i] > -1);
+    }
+    void *closed[2];
+    for (int t = 0; t < 2; t++)
+    {
+        assert(pthread_create(&threads[t], NULL, closer, fds) == 0);
+    }
+    for (int t = 0; t < 2; t++)
+    {
+        pthread_join(threads[t], &closed[t]);
+    }
+    assert((intptr_t) closed[0] + (intptr_t) closed[1] == OPENS);
+    assert(fs_delete("victim") == 0);
+    assert(umount_fs(disk_name) == 0);
+}
+
+// blocks given back by delete and truncate can be taken again at once on a full disk
+static void test_reuse_when_full(char *disk_name)
+{
+    char block[BLOCK_SIZE];
+    memset(block, 'f', BLOCK_SIZE);
+
+    assert(make_fs_sized(disk_name, 300) == 0);
+    assert(mount_fs(disk_name) == 0);
+    assert(fs_create("fill") == 0);
+    int fd = fs_open("fill");
+    ssize_t n;
+    off_t size = 0;
+    while ((n = fs_write(fd, block, BLOCK_SIZE)) > 0)
+    {
+        size += n;
+    }
+    assert(size > 0);
+    assert(fs_close(fd) == 0);
+
+    for (int round = 0; round < 5; round++)
+    {
+        char *name = round % 2 ? "fill" : "again";
+        char *gone = round % 2 ? "again" : "fill";
+        assert(fs_delete(gone) == 0);
+        assert(fs_create(name) == 0);
+        fd = fs_open(name);
+        write_at(fd, round, 0, size);
+
+        // truncate away everything and write it all again straight after
+        assert(fs_truncate(fd, 0) == 0);
+        write_at(fd, round, 0, size);
+        check_at(fd, round, 0, size);
+        assert(fs_close(fd) == 0);
+    }
+    assert(umount_fs(disk_name) == 0);
+}
+
+// a file past 4 GiB, read back at random offsets before and after remounting
+static void test_large_file(char *disk_name)
+{
+    char *buf = malloc(CHUNK);
+
+    assert(make_fs_sized(disk_name, LARGE_BLOCKS) == 0);
+    assert(mount_fs(disk_name) == 0);
+    assert(fs_create("large") == 0);
+    int fd = fs_open("large");
+    for (off_t offset = 0; offset < LARGE_SIZE; offset += CHUNK)
+    {
+        fill(buf, 7, offset, CHUNK);
+        assert(fs_write(fd, buf, CHUNK) == CHUNK);
+    }
+    assert(fs_get_filesize(fd) == LARGE_SIZE);
+    free(buf);
+
+    srand(1);
+    for (int i = 0; i < 1000; i++)
+    {
+        off_t offset = ((off_t) rand() * rand()) % (LARGE_SIZE - 65536);
+        check_at(fd, 7, offset, 1 + rand() % 65536);
+    }
+    check_at(fd, 7, LARGE_SIZE - 1, 1);
+    assert(fs_close(fd) == 0);
+    assert(umount_fs(disk_name) == 0);
+
+    assert(mount_fs(disk_name) == 0);
+    fd = fs_open("large");
+    assert(fs_get_filesize(fd) == LARGE_SIZE);
+    for (int i = 0; i < 200; i++)
+    {
+        off_t offset = ((off_t) rand() * rand()) % (LARGE_SIZE - 4096);
+        check_at(fd, 7, offset, 4096);
+    }
+    assert(fs_close(fd) == 0);
+    assert(fs_delete("large") == 0);
+    assert(umount_fs(disk_name) == 0);
+}
+
+// shrink a file to sizes on and off block boundaries and grow it again
+static void test_truncate_regrow(char *disk_name)
+{
+    off_t full = 3000 * BLOCK_SIZE;
+    off_t lengths[] = { 2000 * BLOCK_SIZE + 17, 1024 * BLOCK_SIZE, 1500, 0, 1025 * BLOCK_SIZE - 1 };
+
+    assert(make_fs(disk_name) == 0);
+    assert(mount_fs(disk_name) == 0);
+    assert(fs_create("grow") == 0);
+    int fd = fs_open("grow");
+    write_at(fd, 1, 0, full);
+
+    for (int i = 0; i < (int) (sizeof(lengths) / sizeof(lengths[0])); i++)
+    {
+        assert(fs_truncate(fd, lengths[i]) == 0);
+        assert(fs_get_filesize(fd) == lengths[i]);
+        assert(fs_truncate(fd, lengths[i] + 1) == -1);
+        if (lengths[i] > 0)
+        {
+            check_at(fd, 1, 0, lengths[i]);
+        }
+        write_at(fd, 1, lengths[i], full - lengths[i]);
+        check_at(fd, 1, 0, full);
+    }
+    assert(fs_close(fd) == 0);
+    assert(umount_fs(disk_name) == 0);
+}
+
+// a descriptor left past the end by a truncate through another one writes at the new end,
+// not into blocks the truncate gave back
+static void test_stale_offset(char *disk_name)
+{
+    assert(make_fs(disk_name) == 0);
+    assert(mount_fs(disk_name) == 0);
+    assert(fs_create("a") == 0);
+    int fd = fs_open("a");
+    int stale = fs_open("a");
+    write_at(fd, 4, 0, 2000 * BLOCK_SIZE);
+    assert(fs_lseek(stale, 7 * BLOCK_SIZE) == 0);
+    assert(fs_truncate(fd, 0) == 0);
+
+    // let the freed blocks go to another file
+    assert(fs_create("v") == 0);
+    int other = fs_open("v");
+    write_at(other, 5, 0, 1900 * BLOCK_SIZE);
+
+    write_at(fd, 4, 0, 10);
+    char buf[BLOCK_SIZE];
+    assert(fs_write(stale, buf, BLOCK_SIZE) == BLOCK_SIZE);
+    assert(fs_get_filesize(fd) == 10 + BLOCK_SIZE);
+    check_at(other, 5, 0, 1900 * BLOCK_SIZE);
+
+    assert(fs_close(fd) == 0);
+    assert(fs_close(stale) == 0);
+    assert(fs_close(other) == 0);
+    assert(umount_fs(disk_name) == 0);
+}
+
+// files written in turns are defragmented a slice at a time while being read
+static void test_defrag_reads(char *disk_name)
+{
+    int fds[4];
+    char name[8];
+    int blocks = 600;
+
+    assert(make_fs(disk_name) == 0);
+    assert(mount_fs(disk_name) == 0);
+    for (int f = 0; f < 4; f++)
+    {
+        sprintf(name, "d%d", f);
+        assert(fs_create(name) == 0);
+        fds[f] = fs_open(name);
+    }
+    for (int b = 0; b < blocks; b++)
+    {
+        for (int f = 0; f < 4; f++)
+        {
+            write_at(fds[f], f, (off_t) b * BLOCK_SIZE, BLOCK_SIZE);
+        }
+    }
+    struct fs_frag_stats stats;
+    assert(fs_frag_stats(&stats) == 0);
+    assert(stats.fragmented == 4);
+
+    int status;
+    srand(2);
+    while ((status = fs_defrag(16)) == 1)
+    {
+        int f = rand() % 4;
+        check_at(fds[f], f, rand() % (blocks * BLOCK_SIZE - 10000), 10000);
+    }
+    assert(status == 0);
+    assert(fs_frag_stats(&stats) == 0);
+    assert(stats.fragmented == 0);
+    assert(stats.index_blocks == 4);
+    assert(stats.free_extents == 1);
+
+    for (int f = 0; f < 4; f++)
+    {
+        check_at(fds[f], f, 0, (size_t) blocks * BLOCK_SIZE);
+        assert(fs_close(fds[f]) == 0);
+    }
+    assert(umount_fs(disk_name) == 0);
+}
+
+// files deleted and truncated while being defragmented give back every block, including
+// the ones held for moving them
+static void test_defrag_drop(char *disk_name)
+{
+    char name[8];
+    int fds[3];
+    int blocks = 1500;
+
+    assert(make_fs(disk_name) == 0);
+    assert(mount_fs(disk_name) == 0);
+    for (int f = 0; f < 3; f++)
+    {
+        sprintf(name, "d%d", f);
+        assert(fs_create(name) == 0);
+        fds[f] = fs_open(name);
+    }
+    for (int b = 0; b < blocks; b++)
+    {
+        for (int f = 0; f < 3; f++)
+        {
+            write_at(fds[f], f, (off_t) b * BLOCK_SIZE, BLOCK_SIZE);
+        }
+    }
+    struct fs_frag_stats stats;
+    assert(fs_frag_stats(&stats) == 0);
+    int total = stats.blocks + stats.index_blocks + stats.free_blocks;
+
+    // drop each of the first two files while it is being moved
+    int status;
+    int slices = 0;
+    while ((status = fs_defrag(8)) == 1)
+    {
+        slices++;
+        if (slices == 100)
+        {
+            assert(fs_close(fds[0]) == 0);
+            assert(fs_delete("d0") == 0);
+        }
+        if (slices == 250)
+        {
+            assert(fs_truncate(fds[1], 10) == 0);
+        }
+    }
+    assert(status == 0);
+    assert(slices > 250);
+
+    // the reclaim worker frees the dropped blocks in the background
+    int tries = 0;
+    do
+    {
+        assert(fs_frag_stats(&stats) == 0);
+        usleep(1000);
+    } while (stats.blocks + stats.index_blocks + stats.free_blocks != total && ++tries < 5000);
+    assert(stats.blocks + stats.index_blocks + stats.free_blocks == total);
+    assert(stats.blocks == blocks + 1);
+    check_at(fds[1], 1, 0, 10);
+    check_at(fds[2], 2, 0, (size_t) blocks * BLOCK_SIZE);
+
+    assert(fs_close(fds[1]) == 0);
+    assert(fs_close(fds[2]) == 0);
+    assert(umount_fs(disk_name) == 0);
+}
+
+// a snapshot taken while mounted holds everything written so far
+static void test_snapshot(char *disk_name)
+{
+    assert(make_fs(disk_name) == 0);
+    assert(mount_fs(disk_name) == 0);
+    assert(fs_create("kept") == 0);
+    int fd = fs_open("kept");
+    write_at(fd, 3, 0, 1500 * BLOCK_SIZE + 99);
+    assert(disk_snapshot("snap.img") == 0);
+    assert(fs_close(fd) == 0);
+    assert(umount_fs(disk_name) == 0);
+    assert(ram_disk_free(disk_name) == 0);
+
+    assert(mount_fs("snap.img") == 0);
+    fd = fs_open("kept");
+    assert(fs_get_filesize(fd) == 1500 * BLOCK_SIZE + 99);
+    check_at(fd, 3, 0, 1500 * BLOCK_SIZE + 99);
+    assert(fs_close(fd) == 0);
+    assert(umount_fs("snap.img") == 0);
+    unlink("snap.img");
+}
+
+int main(int argc, char **argv)
+{
+    // any disk name works, e.g. "ram:mydisk" or "a.img,b.img"
+    char *disk_name = argc > 1 ? argv[1] : "mydisk";
+
+    test_basic(disk_name);
+    test_concurrent_open(disk_name);
+    test_open_delete(disk_name);
+    test_reuse_when_full(disk_name);
+    test_truncate_regrow(disk_name);
+    test_stale_offset(disk_name);
+    test_defrag_reads(disk_name);
+    test_defrag_drop(disk_name);
+    if (strncmp(disk_name, "ram:", 4) == 0)
+    {
+        test_snapshot(disk_name);
+    }
+
+    // needs about 5 GiB of disk, so it gets an image of its own that is removed afterwards
+    if (argc <= 2 || strcmp(argv[2], "-s") != 0)
+    {
+        test_large_file("large.img");
+        unlink("large.img");
+    }
 
+    printf("all tests passed\n");
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,124 @@
+#include "trace.h"
+#include "disk.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#define TRACE_BUFFER (64 * 1024) // bytes of records collected before they are written out
+
+// records are collected in memory and written out a buffer at a time
+pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER; // held for the buffer and the trace file
+int trace_file = -1;        // trace being written, -1 if none
+char *trace_buffer;         // records not yet written
+size_t trace_used = 0;      // bytes in trace_buffer
+uint64_t trace_origin;      // clock reading when the trace started
+
+// monotonic clock in nanoseconds
+uint64_t trace_clock() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// write out buffered records with trace_lock held
+static int trace_write() {
+    size_t done = 0;
+    while (done < trace_used) {
+        ssize_t n = write(trace_file, trace_buffer + done, trace_used - done);
+        if (n <= 0) {
+            perror("trace: cannot write trace");
+            trace_used = 0;
+            return -1;
+        }
+        done += n;
+    }
+    trace_used = 0;
+    return 0;
+}
+
+// start a new trace file
+int trace_open(char *path) {
+    pthread_mutex_lock(&trace_lock);
+    if (trace_file >= 0) {
+        pthread_mutex_unlock(&trace_lock);
+        return -1;
+    }
+    if (!trace_buffer && !(trace_buffer = malloc(TRACE_BUFFER))) {
+        pthread_mutex_unlock(&trace_lock);
+        return -1;
+    }
+    if ((trace_file = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+        perror("trace: cannot open trace");
+        pthread_mutex_unlock(&trace_lock);
+        return -1;
+    }
+
+    struct trace_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_VERSION;
+    header.block_size = BLOCK_SIZE;
+    memcpy(trace_buffer, &header, sizeof(header));
+    trace_used = sizeof(header);
+    trace_origin = trace_clock();
+
+    pthread_mutex_unlock(&trace_lock);
+    return 0;
+}
+
+// write out buffered records so the trace on disk is complete up to now
+int trace_flush() {
+    pthread_mutex_lock(&trace_lock);
+    int status = trace_file >= 0 ? trace_write() : 0;
+    pthread_mutex_unlock(&trace_lock);
+    return status;
+}
+
+// write out buffered records and close the trace
+int trace_close() {
+    pthread_mutex_lock(&trace_lock);
+    if (trace_file < 0) {
+        pthread_mutex_unlock(&trace_lock);
+        return -1;
+    }
+    int status = trace_write();
+    if (close(trace_file) < 0) {
+        status = -1;
+    }
+    trace_file = -1;
+    pthread_mutex_unlock(&trace_lock);
+    return status;
+}
+
+// add a call that began at start (a trace_clock reading) to the trace
+void trace_emit(int op, int fd, char *name, int64_t offset, int64_t size, int64_t result, uint64_t start) {
+    struct trace_record record;
+    size_t name_len = name ? strnlen(name, UINT8_MAX) : 0;
+    record.offset = offset;
+    record.size = size;
+    record.result = result;
+    record.fd = fd;
+    record.op = op;
+    record.name_len = name_len;
+    record.reserved = 0;
+
+    pthread_mutex_lock(&trace_lock);
+    if (trace_file < 0) {
+        pthread_mutex_unlock(&trace_lock);
+        return;
+    }
+    record.time = start > trace_origin ? start - trace_origin : 0;
+    if (trace_used + sizeof(record) + name_len > TRACE_BUFFER) {
+        trace_write();
+    }
+    memcpy(trace_buffer + trace_used, &record, sizeof(record));
+    if (name_len > 0) {
+        memcpy(trace_buffer + trace_used + sizeof(record), name, name_len);
+    }
+    trace_used += sizeof(record) + name_len;
+    pthread_mutex_unlock(&trace_lock);
+}
@@ -0,0 +1,62 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+#define TRACE_MAGIC "VFSTRACE"
+#define TRACE_VERSION 2         // 2 added TRACE_MAKE_FS and failed mounts
+
+// operations found in a trace
+enum trace_op {
+    TRACE_MOUNT = 1,        // mount_fs; size is the number of blocks on the volume (0 if it failed)
+    TRACE_UMOUNT,           // umount_fs
+    TRACE_FILE,             // a file present at mount or when tracing started; size is its size
+    TRACE_OPEN,
+    TRACE_CLOSE,
+    TRACE_CREATE,
+    TRACE_DELETE,
+    TRACE_READ,
+    TRACE_WRITE,
+    TRACE_GET_FILESIZE,
+    TRACE_LISTFILES,
+    TRACE_LSEEK,
+    TRACE_TRUNCATE,
+    TRACE_FRAG_STATS,
+    TRACE_FILE_EXTENTS,
+    TRACE_DEFRAG,
+    TRACE_FAT_BUDGET,
+    TRACE_MAKE_FS,          // make_fs or make_fs_sized; size is the number of blocks, name the disk
+    TRACE_OPS               // number of operations plus one
+};
+
+// start of a trace file
+struct trace_header {
+    char magic[8];          // TRACE_MAGIC
+    uint32_t version;       // TRACE_VERSION
+    uint32_t block_size;    // block size of the traced file system
+};
+
+// one call, followed in the file by name_len bytes of the file name it was given (unterminated);
+// fields are in host byte order
+struct trace_record {
+    uint64_t time;          // nanoseconds from the start of the trace to the call
+    int64_t offset;         // descriptor offset before a read or write, or the offset given to fs_lseek
+    int64_t size;           // bytes asked for, length, blocks or pages given to the call
+    int64_t result;         // what the call returned
+    int32_t fd;             // descriptor given to the call, -1 if none
+    uint8_t op;             // enum trace_op
+    uint8_t name_len;       // bytes of file name following the record
+    uint16_t reserved;
+};
+
+int trace_open(char *path);
+
+int trace_flush();
+
+int trace_close();
+
+uint64_t trace_clock();
+
+void trace_emit(int op, int fd, char *name, int64_t offset, int64_t size, int64_t result, uint64_t start);
+
+#endif
@@ -0,0 +1,562 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "fs.h"
+#include "disk.h"
+
+#define CHUNK_SIZE (1024 * 1024)    // default bytes moved per transfer (256 blocks)
+#define DEPTH 4                     // default number of chunks in flight between threads
+
+// a piece of a file travelling from the producer to the consumer
+struct chunk {
+    char name[MAX_F_NAME + 1];  // file the data belongs to
+    char *data;
+    size_t len;
+    int first;                  // first chunk of the file
+    int last;                   // last chunk of the file
+};
+
+// bounded queue of chunks between the thread reading the source and the thread writing the destination
+struct pipeline {
+    struct chunk *slots;
+    int depth;
+    size_t chunk_size;
+    int head;                   // next slot to consume
+    int tail;                   // next slot to fill
+    int count;                  // filled slots
+    int done;                   // producer has finished
+    int failed;                 // either side has given up
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+};
+
+// what the producer reads from and the consumer writes to
+struct job {
+    struct pipeline *pipe;
+    char *host_dir;
+    int quiet;
+    int room;                   // files the producer may still hand over (import)
+    char (*existing)[MAX_F_NAME + 1]; // names of the files already in the file system (import)
+    int existing_count;         // names in existing
+    int skipped;                // files left out
+    int files;                  // files completed by the consumer
+    long long bytes;            // bytes completed by the consumer
+    struct timespec start;
+    struct timespec last_report;
+};
+
+static double elapsed(struct timespec *from, struct timespec *to) {
+    return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+// print transfer progress at most a few times a second, or unconditionally when final
+static void progress(struct job *job, int final) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (job->quiet || (!final && elapsed(&job->last_report, &now) < 0.25)) {
+        return;
+    }
+    job->last_report = now;
+
+    double secs = elapsed(&job->start, &now);
+    double mib = job->bytes / (1024.0 * 1024.0);
+    fprintf(stderr, "\r%d files, %.1f MiB, %.1f MiB/s   ", job->files, mib, secs > 0 ? mib / secs : 0);
+    if (final) {
+        fprintf(stderr, "\n");
+    }
+}
+
+static int pipeline_init(struct pipeline *pipe, int depth, size_t chunk_size) {
+    memset(pipe, 0, sizeof(struct pipeline));
+    pipe->slots = calloc(depth, sizeof(struct chunk));
+    if (!pipe->slots) {
+        return -1;
+    }
+    int i;
+    for (i = 0; i < depth; i++) {
+        pipe->slots[i].data = malloc(chunk_size);
+        if (!pipe->slots[i].data) {
+            return -1;
+        }
+    }
+    pipe->depth = depth;
+    pipe->chunk_size = chunk_size;
+    pthread_mutex_init(&pipe->lock, NULL);
+    pthread_cond_init(&pipe->not_empty, NULL);
+    pthread_cond_init(&pipe->not_full, NULL);
+    return 0;
+}
+
+static void pipeline_free(struct pipeline *pipe) {
+    int i;
+    for (i = 0; pipe->slots && i < pipe->depth; i++) {
+        free(pipe->slots[i].data);
+    }
+    free(pipe->slots);
+    pthread_mutex_destroy(&pipe->lock);
+    pthread_cond_destroy(&pipe->not_empty);
+    pthread_cond_destroy(&pipe->not_full);
+}
+
+// wait for an empty slot; the producer fills it in place and then calls pipeline_push
+static struct chunk *pipeline_reserve(struct pipeline *pipe) {
+    pthread_mutex_lock(&pipe->lock);
+    while (pipe->count == pipe->depth && !pipe->failed) {
+        pthread_cond_wait(&pipe->not_full, &pipe->lock);
+    }
+    struct chunk *slot = pipe->failed ? NULL : &pipe->slots[pipe->tail];
+    pthread_mutex_unlock(&pipe->lock);
+    return slot;
+}
+
+static void pipeline_push(struct pipeline *pipe) {
+    pthread_mutex_lock(&pipe->lock);
+    pipe->tail = (pipe->tail + 1) % pipe->depth;
+    pipe->count++;
+    pthread_cond_signal(&pipe->not_empty);
+    pthread_mutex_unlock(&pipe->lock);
+}
+
+// wait for a filled slot; NULL once the producer is done and the queue is drained
+static struct chunk *pipeline_peek(struct pipeline *pipe) {
+    pthread_mutex_lock(&pipe->lock);
+    while (pipe->count == 0 && !pipe->done && !pipe->failed) {
+        pthread_cond_wait(&pipe->not_empty, &pipe->lock);
+    }
+    struct chunk *slot = (pipe->count == 0 || pipe->failed) ? NULL : &pipe->slots[pipe->head];
+    pthread_mutex_unlock(&pipe->lock);
+    return slot;
+}
+
+static void pipeline_pop(struct pipeline *pipe) {
+    pthread_mutex_lock(&pipe->lock);
+    pipe->head = (pipe->head + 1) % pipe->depth;
+    pipe->count--;
+    pthread_cond_signal(&pipe->not_full);
+    pthread_mutex_unlock(&pipe->lock);
+}
+
+// mark the producer finished, or either side failed, and wake the other side
+static void pipeline_finish(struct pipeline *pipe, int failed) {
+    pthread_mutex_lock(&pipe->lock);
+    pipe->done = 1;
+    if (failed) {
+        pipe->failed = 1;
+    }
+    pthread_cond_broadcast(&pipe->not_empty);
+    pthread_cond_broadcast(&pipe->not_full);
+    pthread_mutex_unlock(&pipe->lock);
+}
+
+/******************************************************************************/
+/* import: host files -> file system                                          */
+
+// read one host file into the pipeline in chunks
+static int import_file(struct pipeline *pipe, char *path, char *name) {
+    int f = open(path, O_RDONLY);
+    if (f < 0) {
+        perror(path);
+        return 0;
+    }
+
+    int first = 1;
+    int last = 0;
+    while (!last) {
+        struct chunk *slot = pipeline_reserve(pipe);
+        if (!slot) {
+            close(f);
+            return -1;
+        }
+
+        // fill the chunk, marking it last when the file runs out
+        size_t len = 0;
+        while (len < pipe->chunk_size) {
+            ssize_t n = read(f, slot->data + len, pipe->chunk_size - len);
+            if (n < 0) {
+                perror(path);
+                close(f);
+                return -1;
+            }
+            if (n == 0) {
+                last = 1;
+                break;
+            }
+            len += n;
+        }
+
+        strcpy(slot->name, name);
+        slot->len = len;
+        slot->first = first;
+        slot->last = last;
+        pipeline_push(pipe);
+        first = 0;
+    }
+
+    close(f);
+    return 0;
+}
+
+// whether the file system held a file called name before the import started
+static int existing(struct job *job, char *name) {
+    int i;
+    for (i = 0; i < job->existing_count; i++) {
+        if (strcmp(job->existing[i], name) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// walk a host directory; files are named by their path relative to the root of the walk.
+// symbolic links are not followed, so a link back up the tree can not loop
+static int import_tree(struct job *job, char *root, char *rel) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", root, rel);
+
+    DIR *dir = opendir(path);
+    if (!dir) {
+        perror(path);
+        return -1;
+    }
+
+    struct dirent *ent;
+    int status = 0;
+    while (status == 0 && (ent = readdir(dir))) {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
+            continue;
+        }
+
+        char name[4096];
+        snprintf(name, sizeof(name), "%s%s%s", rel, *rel ? "/" : "", ent->d_name);
+        snprintf(path, sizeof(path), "%s/%s", root, name);
+
+        struct stat st;
+        if (lstat(path, &st) == -1) {
+            perror(path);
+            continue;
+        }
+        if (S_ISDIR(st.st_mode)) {
+            status = import_tree(job, root, name);
+        } else if (S_ISLNK(st.st_mode)) {
+            fprintf(stderr, "skipping %s: symbolic link\n", name);
+            job->skipped++;
+        } else if (S_ISREG(st.st_mode)) {
+            if (strlen(name) > MAX_F_NAME) {
+                fprintf(stderr, "skipping %s: name longer than %d characters\n", name, MAX_F_NAME);
+                job->skipped++;
+                continue;
+            }
+            if (existing(job, name)) {
+                fprintf(stderr, "skipping %s: already in the file system\n", name);
+                job->skipped++;
+                continue;
+            }
+            if (job->room == 0) {
+                fprintf(stderr, "skipping %s: file system holds at most %d files\n", name, MAX_FILES_ALLOWED);
+                job->skipped++;
+                continue;
+            }
+            job->room--;
+            status = import_file(job->pipe, path, name);
+        }
+    }
+
+    closedir(dir);
+    return status;
+}
+
+static void *import_producer(void *arg) {
+    struct job *job = arg;
+    int status = import_tree(job, job->host_dir, "");
+    pipeline_finish(job->pipe, status == -1);
+    return NULL;
+}
+
+// write chunks into the file system as they arrive
+static int import_consumer(struct job *job) {
+    struct chunk *slot;
+    int fd = -1;
+    while ((slot = pipeline_peek(job->pipe))) {
+        if (slot->first) {
+            if (fs_create(slot->name) == -1 || (fd = fs_open(slot->name)) == -1) {
+                fprintf(stderr, "cannot create %s\n", slot->name);
+                return -1;
+            }
+        }
+        if (slot->len && fs_write(fd, slot->data, slot->len) != (ssize_t) slot->len) {
+            fprintf(stderr, "cannot write %s: file system full\n", slot->name);
+            return -1;
+        }
+        job->bytes += slot->len;
+        if (slot->last) {
+            fs_close(fd);
+            fd = -1;
+            job->files++;
+        }
+        pipeline_pop(job->pipe);
+        progress(job, 0);
+    }
+    return job->pipe->failed ? -1 : 0;
+}
+
+/******************************************************************************/
+/* export: file system -> host files                                          */
+
+static void *export_producer(void *arg) {
+    struct job *job = arg;
+    struct pipeline *pipe = job->pipe;
+
+    char **files;
+    if (fs_listfiles(&files) == -1) {
+        pipeline_finish(pipe, 1);
+        return NULL;
+    }
+
+    int status = 0;
+    int i;
+    for (i = 0; status == 0 && files[i]; i++) {
+        int fd = fs_open(files[i]);
+        if (fd == -1) {
+            status = -1;
+            break;
+        }
+
+        int first = 1;
+        int last = 0;
+        while (!last) {
+            struct chunk *slot = pipeline_reserve(pipe);
+            if (!slot) {
+                status = -1;
+                break;
+            }
+            ssize_t n = fs_read(fd, slot->data, pipe->chunk_size);
+            if (n == -1) {
+                status = -1;
+                break;
+            }
+            last = n < (ssize_t) pipe->chunk_size;
+            strcpy(slot->name, files[i]);
+            slot->len = n;
+            slot->first = first;
+            slot->last = last;
+            pipeline_push(pipe);
+            first = 0;
+        }
+        fs_close(fd);
+    }
+
+    free(files);
+    pipeline_finish(pipe, status == -1);
+    return NULL;
+}
+
+// create the host directories leading up to a file
+static void make_parents(char *path) {
+    char *sep;
+    for (sep = strchr(path + 1, '/'); sep; sep = strchr(sep + 1, '/')) {
+        *sep = '\0';
+        mkdir(path, 0755);
+        *sep = '/';
+    }
+}
+
+// whether a file name stays below the directory it is exported into
+static int name_inside(char *name) {
+    if (name[0] == '/') {
+        return 0;
+    }
+    char *part = name;
+    while (part) {
+        if (strncmp(part, "..", 2) == 0 && (part[2] == '/' || part[2] == '\0')) {
+            return 0;
+        }
+        part = strchr(part, '/');
+        if (part) {
+            part++;
+        }
+    }
+    return 1;
+}
+
+// write chunks out to host files as they arrive
+static int export_consumer(struct job *job) {
+    struct chunk *slot;
+    int f = -1;
+    int skipping = 0;
+    char path[4096];
+    while ((slot = pipeline_peek(job->pipe))) {
+        // absolute names and names with ".." would land outside host-dir
+        if (slot->first && !name_inside(slot->name)) {
+            fprintf(stderr, "skipping %s: name leads outside %s\n", slot->name, job->host_dir);
+            job->skipped++;
+            skipping = 1;
+        }
+        if (skipping) {
+            skipping = !slot->last;
+            pipeline_pop(job->pipe);
+            continue;
+        }
+        if (slot->first) {
+            snprintf(path, sizeof(path), "%s/%s", job->host_dir, slot->name);
+            make_parents(path);
+            if ((f = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+                perror(path);
+                return -1;
+            }
+        }
+        size_t done = 0;
+        while (done < slot->len) {
+            ssize_t n = write(f, slot->data + done, slot->len - done);
+            if (n < 0) {
+                perror(path);
+                close(f);
+                return -1;
+            }
+            done += n;
+        }
+        job->bytes += slot->len;
+        if (slot->last) {
+            close(f);
+            f = -1;
+            job->files++;
+        }
+        pipeline_pop(job->pipe);
+        progress(job, 0);
+    }
+    return job->pipe->failed ? -1 : 0;
+}
+
+/******************************************************************************/
+
+static void usage(char *prog) {
+    fprintf(stderr, "usage: %s [-f] [-b blocks] [-q] [-c chunk-kib] [-n depth] import|export disk host-dir\n", prog);
+    fprintf(stderr, "  -f  make a fresh file system on the disk before importing\n");
+    fprintf(stderr, "  -b  blocks on the disk made by -f (default %d)\n", DISK_BLOCKS);
+    fprintf(stderr, "  -q  do not print progress\n");
+    fprintf(stderr, "  -c  KiB moved per transfer (default %d)\n", CHUNK_SIZE / 1024);
+    fprintf(stderr, "  -n  chunks in flight between the reader and writer (default %d)\n", DEPTH);
+}
+
+int main(int argc, char **argv) {
+    int format = 0;
+    int blocks = DISK_BLOCKS;
+    int quiet = 0;
+    int chunk_kib = CHUNK_SIZE / 1024;
+    int depth = DEPTH;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "fb:qc:n:")) != -1) {
+        switch (opt) {
+        case 'f':
+            format = 1;
+            break;
+        case 'b':
+            blocks = atoi(optarg);
+            break;
+        case 'q':
+            quiet = 1;
+            break;
+        case 'c':
+            chunk_kib = atoi(optarg);
+            break;
+        case 'n':
+            depth = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind != argc - 3 || chunk_kib <= 0 || depth <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    int importing = strcmp(argv[optind], "import") == 0;
+    if (!importing && strcmp(argv[optind], "export") != 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    char *disk_name = argv[optind + 1];
+    char *host_dir = argv[optind + 2];
+
+    if (importing && format && make_fs_sized(disk_name, blocks) == -1) {
+        fprintf(stderr, "%s: cannot make file system on %s\n", argv[0], disk_name);
+        return 1;
+    }
+    if (mount_fs(disk_name) == -1) {
+        fprintf(stderr, "%s: cannot mount %s\n", argv[0], disk_name);
+        return 1;
+    }
+    if (!importing) {
+        mkdir(host_dir, 0755);
+    }
+
+    struct pipeline pipe;
+    if (pipeline_init(&pipe, depth, (size_t) chunk_kib * 1024) == -1) {
+        fprintf(stderr, "%s: out of memory\n", argv[0]);
+        return 1;
+    }
+
+    struct job job;
+    memset(&job, 0, sizeof(job));
+    job.pipe = &pipe;
+    job.host_dir = host_dir;
+    job.quiet = quiet;
+
+    // files past the directory's capacity, or already in it, are skipped rather than
+    // failing the import; the producer checks names against a copy taken here, as only
+    // this thread uses the file system
+    if (importing) {
+        char **files;
+        job.existing = malloc(MAX_FILES_ALLOWED * sizeof(*job.existing));
+        if (!job.existing || fs_listfiles(&files) == -1) {
+            fprintf(stderr, "%s: cannot list %s\n", argv[0], disk_name);
+            return 1;
+        }
+        while (files[job.existing_count]) {
+            strcpy(job.existing[job.existing_count], files[job.existing_count]);
+            job.existing_count++;
+        }
+        free(files);
+        job.room = MAX_FILES_ALLOWED - job.existing_count;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &job.start);
+    job.last_report = job.start;
+
+    // one thread reads the source while this one writes the destination; only one
+    // side touches the file system, so it is never used from two threads at once
+    pthread_t producer;
+    if (pthread_create(&producer, NULL, importing ? import_producer : export_producer, &job) != 0) {
+        fprintf(stderr, "%s: cannot start a thread\n", argv[0]);
+        free(job.existing);
+        pipeline_free(&pipe);
+        umount_fs(disk_name);
+        return 1;
+    }
+    int status = importing ? import_consumer(&job) : export_consumer(&job);
+    if (status == -1) {
+        pipeline_finish(&pipe, 1);
+    }
+    pthread_join(producer, NULL);
+    progress(&job, 1);
+    if (job.skipped) {
+        fprintf(stderr, "%d files skipped\n", job.skipped);
+    }
+    free(job.existing);
+    pipeline_free(&pipe);
+
+    if (umount_fs(disk_name) == -1) {
+        fprintf(stderr, "%s: cannot unmount %s\n", argv[0], disk_name);
+        return 1;
+    }
+
+    return status == -1 || pipe.failed ? 1 : 0;
+}